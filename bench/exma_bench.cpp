@@ -0,0 +1,115 @@
+﻿//Benchmarks for the exma analysis stages on a synthetic stack, so the hot paths can be profiled without image data
+//Usage: exma_bench [width] [height] [depth] [repetitions] [threads]
+
+#include "exma.h"
+#include <chrono>
+
+//Best wall time of several runs of func, in milliseconds
+template<typename Func>
+double timeBest(int repetitions, Func func)
+{
+	double best = 0.;
+	for (int r = 0; r < repetitions; r++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		func();
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (r == 0 || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+void report(const std::string& stage, double ms)
+{
+	std::cout << stage << ": " << ms << " ms" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	EnvironmentVariables env;
+	env.WIDTH = argc > 1 ? atoi(argv[1]) : 2048;
+	env.HEIGHT = argc > 2 ? atoi(argv[2]) : 2048;
+	env.DEPTH = argc > 3 ? atoi(argv[3]) : 60;
+	int repetitions = argc > 4 ? atoi(argv[4]) : 3;
+	env.THREADS = argc > 5 ? atoi(argv[5]) : 0;
+	if (env.THREADS <= 0)
+		env.THREADS = std::max(1u, std::thread::hardware_concurrency());
+
+	env.THRESHOLD = 50;
+	env.MAX_SPACE = 5;
+	env.LAYER_MEDIAN = 0;
+	env.LAYER_BLUR = 0;
+	env.VERBOSE = false;
+	env.BINARIZE = false;
+	env.A_CONCENTRATION = false;
+	env.CONC_FIDELITY = 30;
+	env.MIX_X = env.WIDTH / 8;
+	env.MIX_Y = env.HEIGHT / 2;
+	env.FACING = false;
+
+	std::cout << "Stack " << env.WIDTH << " x " << env.HEIGHT << " x " << env.DEPTH << ", " << env.THREADS << " threads, best of " << repetitions << std::endl;
+
+	//Synthetic biofilm: each column is filled up to a varying height, with sparse noise and gaps above it
+	ImageStack stack;
+	stack.allocate(env.WIDTH, env.HEIGHT, env.DEPTH);
+	uint32_t seed = 12345;
+	for (size_t v = 0; v < stack.voxels.size(); v++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		int z = int(v % env.DEPTH);
+		size_t pixel = v / env.DEPTH;
+		int top = int((pixel * 2654435761u) % (env.DEPTH + 1));
+		stack.voxels[v] = (z < top) ? ((seed >> 24) < 230 ? 200 : 10) : ((seed >> 24) < 8 ? 120 : 20);
+	}
+
+	BitStack bitStack;
+	bitStack.WIDTH = env.WIDTH;
+	bitStack.HEIGHT = env.HEIGHT;
+	bitStack.DEPTH = env.DEPTH;
+	bitStack.WORDS = (env.DEPTH + 63) / 64;
+	bitStack.bits.assign(size_t(env.WIDTH) * env.HEIGHT * bitStack.WORDS, 0);
+	for (int i = 0; i < env.HEIGHT; i++)
+	{
+		for (int j = 0; j < env.WIDTH; j++)
+		{
+			const unsigned char* column = stack.column(j, i);
+			uint64_t* bits = bitStack.column(j, i);
+			for (int z = 0; z < env.DEPTH; z++)
+			{
+				if (column[z] > env.THRESHOLD)
+					bits[z / 64] |= uint64_t(1) << (z % 64);
+			}
+		}
+	}
+
+	cimg_library::CImg<unsigned char> biofilm_image, display_image;
+
+	report("calcBiofilm (byte stack)", timeBest(repetitions, [&]() { calcBiofilm(&stack, &env, &biofilm_image, &display_image); }));
+	report("calcBiofilm (bit stack)", timeBest(repetitions, [&]() { calcBiofilm(&bitStack, &env, &biofilm_image, &display_image); }));
+
+	//Blur of one layer, restored before every run
+	cimg_library::CImg<unsigned char> layer(env.WIDTH, env.HEIGHT), blurred;
+	for (size_t p = 0; p < layer.size(); p++)
+		layer[p] = stack.voxels[p * env.DEPTH % stack.voxels.size()];
+	for (int sigma : { 2, 20 })
+	{
+		report("blurLayer (sigma " + std::to_string(sigma) + ")", timeBest(repetitions, [&]() { blurred = layer; blurLayer(&blurred, float(sigma)); }));
+		std::vector<uint64_t> mask;
+		report("blurThreshold (sigma " + std::to_string(sigma) + ")", timeBest(repetitions, [&]() { blurred = layer; blurThreshold(&blurred, float(sigma), env.THRESHOLD, &mask); }));
+	}
+
+	//Median of one layer, which should cost the same for any radius
+	for (int radius : { 1, 5, 20 })
+	{
+		report("medianLayer (radius " + std::to_string(radius) + ")", timeBest(repetitions, [&]() { blurred = layer; medianLayer(&blurred, radius, env.THREADS); }));
+	}
+
+	for (int fidelity : { 30, 200 })
+	{
+		env.CONC_FIDELITY = fidelity;
+		report("calcConcentrationGradient (" + std::to_string(fidelity) + " terms)", timeBest(repetitions, [&]() { calcConcentrationGradient(&env); }));
+	}
+
+	return 0;
+}
@@ -1,562 +1,2510 @@
 ﻿//Tyson Klein 2018
 
-#define _USE_MATH_DEFINES
-#include <math.h>
-#include <iostream>
-#include <string>
-#include <fstream>
-#include <experimental/filesystem> //File manipulation
-#include "CImg.h" //Image processor
-#include "cxxopts.hpp" //Command line argument parser
-
-namespace fs = std::experimental::filesystem;
-
-//Holds important environment values between contexts
-struct EnvironmentVariables
-{
-	//File-specific variables
-	int HEIGHT, WIDTH, DEPTH;
-	bool FACING;
-	std::string imageFolderName;
-	std::vector<std::string> imageFileNames;
-
-	//Command line arg variables
-	int TABLE_BIN_SIZE, MAX_SPACE, CONC_STEP, THRESHOLD, LAYER_BLUR, DISP_PERCENT, DISP_HEIGHT, DISP_WIDTH, CONC_OFFSET, CONC_FIDELITY;
-	bool DISPLAY, SAVE, VERBOSE, OVERLAY, TABLE, A_BIOFILM = true, A_CONCENTRATION;
-
-	//Values that are determined in program
-	int MIX_X, MIX_Y, MAX_THICKNESS;
-
-	//Config variables, These will all be changed by the config file unless left out
-	float CROSS_AREA = 30000; // micrometers squared
-	float FLOW_RATE = 5.f; //microliters per hour
-	float PIXEL_WIDTH = 0.15; //micrometers
-	float LAYER_THICKNESS = 1.f; //micrometers
-	float DIFFUSIVITY = 1000.f; //micrometers squared per second
-	float CHAN_WIDTH = 350.f; //micrometers
-};
+#include "exma.h"
+
+void setEnvironmentVariables(EnvironmentVariables* env)
+{
+	if (env->OUTPUT_FORMAT != "bmp" && env->OUTPUT_FORMAT != "png" && env->OUTPUT_FORMAT != "tiff")
+		throw "Unknown output format: please give bmp, png or tiff to --format";
+	if (!env->SAVE_THICKNESS.empty() && env->SAVE_THICKNESS != "raw" && env->SAVE_THICKNESS != "tiff" && env->SAVE_THICKNESS != "npy")
+		throw "Unknown thickness map format: please give raw, tiff or npy to --save_thickness";
+	if (!env->AUTO_THRESHOLD.empty() && env->AUTO_THRESHOLD != "otsu" && env->AUTO_THRESHOLD != "triangle" && env->AUTO_THRESHOLD != "li")
+		throw "Unknown threshold method: please give otsu, triangle or li to --auto_threshold";
+	if (env->LAYER_MEDIAN < 0 || env->LAYER_MEDIAN > 127)
+		throw "The --layer_median radius must be between 0 and 127";
+#ifndef EXMA_ZLIB
+	if (env->OUTPUT_FORMAT == "png")
+		throw "This build of exma has no zlib to write PNG files: please save as bmp or tiff";
+#endif
+
+	//Check if image folder exists
+	if (!fs::exists(env->imageFolderName))
+	{
+		throw ("Image folder path " + env->imageFolderName + " does not exist").c_str();
+	}
+
+	//A single multi-page TIFF holds the whole stack, with the bottom layer as the first page
+	if (fs::is_regular_file(env->imageFolderName))
+	{
+		std::string extension = fs::path(env->imageFolderName).extension().u8string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (extension != ".tif" && extension != ".tiff")
+			throw "A single input file must be a multi-page TIFF stack";
+
+		TiffStack tiff;
+		tiff.open(env->imageFolderName);
+		env->imageFileNames = { env->imageFolderName };
+		env->STACK_FILE = true;
+		env->WIDTH = tiff.WIDTH;
+		env->HEIGHT = tiff.HEIGHT;
+		env->DEPTH = tiff.DEPTH;
+		env->BIT_DEPTH = tiff.BITS;
+
+		//Greyscale stacks only have the one channel to analyse
+		const int channels = std::max(tiff.SAMPLES, tiff.CHANNELS);
+		if (channels > 1 && (env->CHANNEL < 0 || env->CHANNEL >= channels))
+			throw "Selected channel is not in the images: please check the --channel option";
+
+		if (env->DEPTH == 1)
+			throw "Multiple images required for analysis";
+		return;
+	}
+
+	int number_of_images = 0, number_of_non_images = 0;
+
+	//Initialize vector of image names to be blank
+	env->imageFileNames = {};
+
+	for (auto & p : fs::directory_iterator(env->imageFolderName))
+	{
+		//Convert Path to string
+		static std::string filename;
+		filename = p.path().u8string();
+
+		//Check if string represents a subfolder
+		if (filename.find(".") == std::string::npos)
+		{
+			throw "Image folder must not contain subfolders";
+		}
+
+		//Set list of supported file types
+		std::vector<std::string> supported_types;
+		supported_types = { "bmp" , "BMP" };
+
+		//Ensure the file is a supported filetype
+		if (std::find(supported_types.begin(), supported_types.end(), filename.substr(filename.find_last_of(".") + 1)) != supported_types.end()) {
+			//Add file to the image list
+			env->imageFileNames.emplace_back(filename);
+			number_of_images++;
+		}
+		else {
+			number_of_non_images++;
+		}
+	}
+
+	//Directory order is only alphabetical on some file systems, and the bottom layer must come first
+	std::sort(env->imageFileNames.begin(), env->imageFileNames.end());
+
+	//Set the depth to be the number of images in the folder
+	env->DEPTH = number_of_images;
+
+	if (number_of_images == 0)
+		throw "No supported images in directory";
+
+	if (number_of_images == 1)
+		throw "Multiple images required for analysis";
+
+	if (number_of_non_images == 1)
+		std::cout << "Found " << number_of_non_images << " unsupported file. This will be ignored" << std::endl;
+	else if (number_of_non_images > 1)
+		std::cout << "Found " << number_of_non_images << " unsupported files. These will be ignored" << std::endl;
+}
+
+//Read the dimensions of a layer from its BMP header, without decoding the pixels
+bool readImageSize(const std::string& imageName, int* width, int* height)
+{
+	std::ifstream file(imageName, std::ios::binary);
+	unsigned char header[26];
+	if (!file.read((char*)header, sizeof(header)) || header[0] != 'B' || header[1] != 'M')
+		return false;
+
+	auto read32 = [&](int offset) { return int32_t(header[offset] | header[offset + 1] << 8 | header[offset + 2] << 16 | uint32_t(header[offset + 3]) << 24); };
+	if (read32(14) == 12) //The old BITMAPCOREHEADER stores 16-bit dimensions
+	{
+		*width = header[18] | header[19] << 8;
+		*height = header[20] | header[21] << 8;
+	}
+	else
+	{
+		*width = read32(18);
+		*height = abs(read32(22)); //A negative height marks top-down rows
+	}
+	return *width > 0 && *height > 0;
+}
+
+//Determine the image dimensions from the first layer, so the stack can be allocated before any layer is decoded
+void initDimensions(EnvironmentVariables* env)
+{
+	//TIFF stacks have already been measured while counting their pages
+	if (!env->STACK_FILE && !readImageSize(env->imageFileNames[0], &env->WIDTH, &env->HEIGHT))
+	{
+		//Not a header we understand, so let CImg decode it
+		cimg_library::CImg<unsigned char> src(env->imageFileNames[0].c_str());
+		env->WIDTH = src.width();
+		env->HEIGHT = src.height();
+	}
+	env->DISP_HEIGHT = env->HEIGHT*(float(env->DISP_PERCENT)*0.01f);
+	env->DISP_WIDTH = env->WIDTH*(float(env->DISP_PERCENT)*0.01f);
+}
+
+//Decode the analysed channel of a single layer, making sure its dimensions are consistent with the first layer
+//The other channels are dropped straight away, so only one byte per pixel is blurred and kept
+cimg_library::CImg<unsigned char> decodeLayer(const std::string& imageName, EnvironmentVariables* env)
+{
+	cimg_library::CImg<unsigned char> src(imageName.c_str());
+
+	if (src.width() != env->WIDTH || src.height() != env->HEIGHT)
+	{
+		throw "Inconsistent image dimensions: please check that all images in folder are the same dimensions";
+	}
+
+	//Greyscale images only have the one channel to analyse
+	if (src.spectrum() > 1)
+	{
+		if (env->CHANNEL < 0 || env->CHANNEL >= src.spectrum())
+			throw "Selected channel is not in the images: please check the --channel option";
+		src.channel(env->CHANNEL);
+	}
+
+	return src;
+}
+
+bool MappedFile::open(const std::string& fileName)
+{
+	close();
+	void* mapping = nullptr;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	HANDLE fileMapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		fileMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (fileMapping == NULL)
+		return false;
+	mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(fileMapping);
+	if (mapping == NULL)
+		return false;
+	size = size_t(fileSize.QuadPart);
+#else
+	int file = ::open(fileName.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat fileStat;
+	if (fstat(file, &fileStat) != 0 || fileStat.st_size <= 0)
+	{
+		::close(file);
+		return false;
+	}
+	size = size_t(fileStat.st_size);
+	mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	::close(file);
+	if (mapping == MAP_FAILED)
+	{
+		size = 0;
+		return false;
+	}
+	madvise(mapping, size, MADV_WILLNEED);
+#endif
+
+	data = (const unsigned char*)mapping;
+	return true;
+}
+
+void MappedFile::adopt(std::vector<unsigned char>&& fileContents)
+{
+	close();
+	contents = std::move(fileContents);
+	data = contents.data();
+	size = contents.size();
+}
+
+void MappedFile::close()
+{
+	if (data && contents.empty())
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, size);
+#endif
+	}
+	std::vector<unsigned char>().swap(contents);
+	data = nullptr;
+	size = 0;
+}
+
+bool MappedBmp::open(const std::string& imageName, int channel)
+{
+	close();
+	return file.open(imageName) && parse(channel);
+}
+
+bool MappedBmp::open(std::vector<unsigned char>&& fileContents, int channel)
+{
+	close();
+	file.adopt(std::move(fileContents));
+	return parse(channel);
+}
 
-//Holds the colour values of a pixel
-struct colour
+bool MappedBmp::parse(int channel)
 {
-	int R, G, B;
+	//Validate the BITMAPFILEHEADER and BITMAPINFOHEADER, leaving anything unusual (compression, bit fields, other depths) to CImg
+	const unsigned char* data = file.data;
+	auto read16 = [&](size_t offset) { return int(data[offset] | data[offset + 1] << 8); };
+	auto read32 = [&](size_t offset) { return int32_t(data[offset] | data[offset + 1] << 8 | data[offset + 2] << 16 | uint32_t(data[offset + 3]) << 24); };
+	if (file.size < 54 || data[0] != 'B' || data[1] != 'M' || channel < 0 || channel > 2)
+	{
+		close();
+		return false;
+	}
+	const int32_t headerSize = read32(14), storedHeight = read32(22), compression = read32(30);
+	const int64_t pixelOffset = uint32_t(read32(10));
+	WIDTH = read32(18);
+	HEIGHT = abs(storedHeight);
+	BITS = read16(28);
+	if (headerSize < 40 || read16(26) != 1 || compression != 0 || (BITS != 8 && BITS != 24) || WIDTH <= 0 || HEIGHT <= 0)
+	{
+		close();
+		return false;
+	}
+
+	//Rows are padded to 4 bytes
+	const int64_t rowBytes = ((int64_t(WIDTH) * BITS + 31) / 32) * 4;
+	if (pixelOffset + rowBytes * HEIGHT > int64_t(file.size))
+	{
+		close();
+		return false;
+	}
+
+	if (BITS == 8)
+	{
+		//The palette follows the info header as BGRx entries; a used count of 0 means a full palette
+		const int64_t colours = read32(46) > 0 ? std::min(read32(46), 256) : 256;
+		const int64_t paletteOffset = 14 + int64_t(headerSize);
+		if (paletteOffset + colours * 4 > pixelOffset)
+		{
+			close();
+			return false;
+		}
+		for (int index = 0; index < 256; index++)
+			palette[index] = index < colours ? data[paletteOffset + index * 4 + 2 - channel] : 0;
+	}
+	channelOffset = 2 - channel;
+
+	//Positive heights are stored bottom row first
+	if (storedHeight > 0)
+	{
+		pixels = data + pixelOffset + rowBytes * (HEIGHT - 1);
+		stride = -rowBytes;
+	}
+	else
+	{
+		pixels = data + pixelOffset;
+		stride = rowBytes;
+	}
+	return true;
+}
+
+void MappedBmp::close()
+{
+	file.close();
+	pixels = nullptr;
+}
+
+//Read an unsigned value of 1 to 8 bytes in the file's byte order
+uint64_t TiffStack::read(uint64_t offset, int bytes) const
+{
+	if (offset + bytes > file.size)
+		throw "TIFF stack is truncated or corrupt";
+
+	uint64_t value = 0;
+	for (int b = 0; b < bytes; b++)
+		value |= uint64_t(file.data[offset + b]) << (8 * (bigEndian ? bytes - 1 - b : b));
+	return value;
+}
+
+void TiffStack::open(const std::string& fileName)
+{
+	if (!file.open(fileName))
+		throw "Could not open the TIFF stack";
+	if (file.size < 16 || file.data[0] != file.data[1] || (file.data[0] != 'I' && file.data[0] != 'M'))
+		throw "Input file is not a TIFF stack";
+	bigEndian = file.data[0] == 'M';
+
+	//Classic TIFF has 32-bit offsets and 12-byte directory entries, BigTIFF has 64-bit offsets and 20-byte entries
+	const uint64_t version = read(2, 2);
+	if (version != 42 && version != 43)
+		throw "Input file is not a TIFF stack";
+	const bool bigTiff = version == 43;
+	const int offsetBytes = bigTiff ? 8 : 4, countBytes = bigTiff ? 8 : 2, entryBytes = bigTiff ? 20 : 12;
+
+	std::string description;
+	strips.clear();
+	rowsPerStrip.clear();
+
+	//Each page is one image file directory, linked to the next
+	for (uint64_t directory = bigTiff ? read(8, 8) : read(4, 4); directory != 0; )
+	{
+		//A corrupt file could link its directories in a loop
+		if (strips.size() > file.size / entryBytes)
+			throw "TIFF stack is truncated or corrupt";
+
+		int width = 0, height = 0, bits = 1, samples = 1, compression = 1, planar = 1, format = 1, rows = 0;
+		bool tiled = false;
+		std::vector<uint64_t> offsets;
+
+		const uint64_t entries = read(directory, countBytes);
+		for (uint64_t e = 0; e < entries; e++)
+		{
+			const uint64_t entry = directory + countBytes + e * entryBytes;
+			const int tag = int(read(entry, 2)), type = int(read(entry + 2, 2));
+			const uint64_t count = read(entry + 4, offsetBytes);
+
+			//Values are kept in the entry itself when they fit, and at the offset it holds otherwise
+			const int size = type == 3 ? 2 : type == 4 ? 4 : (type == 5 || type == 16) ? 8 : 1;
+			if (count > file.size / size)
+				throw "TIFF stack is truncated or corrupt";
+			const uint64_t values = count * size <= uint64_t(offsetBytes) ? entry + 4 + offsetBytes : read(entry + 4 + offsetBytes, offsetBytes);
+			auto value = [&](uint64_t i) { return read(values + i * size, size); };
+
+			switch (tag)
+			{
+			case 256: width = int(value(0)); break; //ImageWidth
+			case 257: height = int(value(0)); break; //ImageLength
+			case 258: bits = int(value(0)); break; //BitsPerSample
+			case 259: compression = int(value(0)); break; //Compression
+			case 270: //ImageDescription, which holds the OME-XML metadata
+				if (strips.empty() && values + count <= file.size)
+					description.assign((const char*)file.data + values, size_t(count));
+				break;
+			case 273: //StripOffsets
+				offsets.resize(size_t(count));
+				for (uint64_t i = 0; i < count; i++)
+					offsets[i] = value(i);
+				break;
+			case 277: samples = int(value(0)); break; //SamplesPerPixel
+			case 278: rows = int(std::min<uint64_t>(value(0), INT32_MAX)); break; //RowsPerStrip
+			case 284: planar = int(value(0)); break; //PlanarConfiguration
+			case 322: case 323: case 324: tiled = true; break; //TileWidth, TileLength, TileOffsets
+			case 339: format = int(value(0)); break; //SampleFormat
+			default: break;
+			}
+		}
+
+		if (tiled || compression != 1 || (planar != 1 && samples > 1) || format != 1 || (bits != 8 && bits != 16) || samples < 1)
+			throw "TIFF stack must hold uncompressed 8 or 16-bit unsigned integer strips";
+		if (width <= 0 || height <= 0)
+			throw "TIFF stack is truncated or corrupt";
+		if (strips.empty())
+		{
+			WIDTH = width;
+			HEIGHT = height;
+			BITS = bits;
+			SAMPLES = samples;
+		}
+		else if (width != WIDTH || height != HEIGHT || bits != BITS || samples != SAMPLES)
+		{
+			throw "Inconsistent image dimensions: please check that all pages of the TIFF stack are the same dimensions and format";
+		}
+
+		//A missing RowsPerStrip means the whole page is one strip, and every strip must lie inside the file
+		if (rows <= 0 || rows > height)
+			rows = height;
+		const uint64_t rowBytes = uint64_t(width) * samples * bits / 8;
+		if (offsets.size() < size_t((height + rows - 1) / rows))
+			throw "TIFF stack is truncated or corrupt";
+		for (size_t s = 0; s * rows < size_t(height); s++)
+		{
+			const uint64_t stripRows = std::min<uint64_t>(rows, height - s * rows);
+			if (offsets[s] + stripRows * rowBytes > file.size)
+				throw "TIFF stack is truncated or corrupt";
+		}
+
+		strips.push_back(offsets);
+		rowsPerStrip.push_back(rows);
+		directory = read(directory + countBytes + entries * entryBytes, offsetBytes);
+	}
+
+	if (strips.empty())
+		throw "TIFF stack is truncated or corrupt";
+	DEPTH = int(strips.size());
+	CHANNELS = 1;
+	strideZ = 1;
+	strideC = 0;
+
+	//OME-TIFF lists how the channels, z-slices and time points are spread over the pages; only the first time point is used
+	if (description.find("<OME") != std::string::npos)
+	{
+		auto attribute = [&](const std::string& name) {
+			size_t at = description.find(" " + name + "=\"");
+			if (at == std::string::npos)
+				return std::string();
+			at += name.size() + 3;
+			return description.substr(at, description.find('"', at) - at);
+		};
+		const int sizeZ = atoi(attribute("SizeZ").c_str()), sizeC = atoi(attribute("SizeC").c_str()), sizeT = atoi(attribute("SizeT").c_str());
+		std::string order = attribute("DimensionOrder");
+		if (order.size() != 5 || order.compare(0, 2, "XY") != 0 || order.find('Z') == std::string::npos || order.find('C') == std::string::npos || order.find('T') == std::string::npos)
+			order = "XYCZT";
+
+		//Interleaved samples (RGB) are counted in SizeC but are not separate pages
+		const int channels = SAMPLES == 1 && sizeC > 1 ? sizeC : 1;
+		if (sizeZ > 0)
+		{
+			//Each dimension's pages are spread out by the product of the sizes of the dimensions inside it
+			int64_t stride = 1, strides[3] = {};
+			for (int dimension = 2; dimension < 5; dimension++)
+			{
+				const int at = int(std::string("ZCT").find(order[dimension]));
+				strides[at] = stride;
+				stride *= at == 0 ? sizeZ : at == 1 ? channels : std::max(1, sizeT);
+			}
+			if ((sizeZ - 1) * strides[0] + (channels - 1) * strides[1] >= DEPTH)
+				throw "OME-TIFF stack holds fewer pages than its SizeZ, SizeC and SizeT describe";
+			CHANNELS = channels;
+			DEPTH = sizeZ;
+			strideZ = strides[0];
+			strideC = strides[1];
+		}
+	}
+}
+
+int TiffStack::page(int layer, int channel) const
+{
+	return int(layer * strideZ + channel * strideC);
+}
+
+const unsigned char* TiffStack::rowData(int page, int y) const
+{
+	const uint64_t rowBytes = uint64_t(WIDTH) * SAMPLES * BITS / 8;
+	return file.data + strips[page][y / rowsPerStrip[page]] + (y % rowsPerStrip[page]) * rowBytes;
+}
+
+template<typename Sample>
+void TiffStack::readRow(int page, int y, int sample, Sample* out) const
+{
+	const unsigned char* src = rowData(page, y) + sample * (BITS / 8);
+	const int step = SAMPLES * (BITS / 8);
+	if (BITS == 8)
+	{
+		for (int x = 0; x < WIDTH; x++)
+			out[x] = src[x * step];
+	}
+	else if (bigEndian)
+	{
+		for (int x = 0; x < WIDTH; x++)
+			out[x] = Sample(src[x * step] << 8 | src[x * step + 1]);
+	}
+	else
+	{
+		for (int x = 0; x < WIDTH; x++)
+			out[x] = Sample(src[x * step] | src[x * step + 1] << 8);
+	}
+}
+
+#ifdef EXMA_IO_URING
+//io_uring through the raw system calls, since liburing is not a dependency
+struct IoRing
+{
+	int fd = -1;
+	io_uring_params params = {};
+	unsigned char* maps[3] = {}; //Submission ring, completion ring and submission entries
+	size_t sizes[3] = {};
+	unsigned queued = 0; //Entries queued but not yet submitted
+
+	~IoRing()
+	{
+		for (int map = 0; map < 3; map++)
+		{
+			if (maps[map])
+				munmap(maps[map], sizes[map]);
+		}
+		if (fd >= 0)
+			::close(fd);
+	}
+
+	//False if the kernel does not allow io_uring (too old, or disabled for this process)
+	bool open(unsigned entries)
+	{
+		fd = int(syscall(__NR_io_uring_setup, entries, &params));
+		if (fd < 0)
+			return false;
+
+		sizes[0] = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		sizes[1] = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		sizes[2] = params.sq_entries * sizeof(io_uring_sqe);
+		const off_t offsets[3] = { IORING_OFF_SQ_RING, IORING_OFF_CQ_RING, IORING_OFF_SQES };
+		for (int map = 0; map < 3; map++)
+		{
+			void* mapping = mmap(nullptr, sizes[map], PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offsets[map]);
+			if (mapping == MAP_FAILED)
+				return false;
+			maps[map] = (unsigned char*)mapping;
+		}
+		return true;
+	}
+
+	unsigned* field(int map, unsigned offset) { return (unsigned*)(maps[map] + offset); }
+
+	//Queue a read of the file into the buffer, with tag returned in its completion. Only this thread writes the submission tail
+	void queueRead(int file, iovec* buffer, uint64_t offset, uint64_t tag)
+	{
+		const unsigned tail = *field(0, params.sq_off.tail), index = tail & *field(0, params.sq_off.ring_mask);
+		io_uring_sqe* entry = (io_uring_sqe*)maps[2] + index;
+		memset(entry, 0, sizeof(*entry));
+		entry->opcode = IORING_OP_READV;
+		entry->fd = file;
+		entry->addr = uint64_t(uintptr_t(buffer));
+		entry->len = 1;
+		entry->off = offset;
+		entry->user_data = tag;
+		field(0, params.sq_off.array)[index] = index;
+		__atomic_store_n(field(0, params.sq_off.tail), tail + 1, __ATOMIC_RELEASE);
+		queued++;
+	}
+
+	//Submit the queued reads and wait for at least one to complete
+	bool submitAndWait()
+	{
+		const int submitted = int(syscall(__NR_io_uring_enter, fd, queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (submitted < 0)
+			return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+		queued -= unsigned(submitted);
+		return true;
+	}
+
+	//Wait for at least one submitted read to complete, without submitting any more
+	bool wait()
+	{
+		while (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0)
+		{
+			if (errno != EINTR)
+				return false;
+		}
+		return true;
+	}
+
+	//Take the next completion, false if there are none
+	bool complete(io_uring_cqe* completion)
+	{
+		unsigned* head = field(1, params.cq_off.head);
+		if (*head == __atomic_load_n(field(1, params.cq_off.tail), __ATOMIC_ACQUIRE))
+			return false;
+		*completion = ((io_uring_cqe*)(maps[1] + params.cq_off.cqes))[*head & *field(1, params.cq_off.ring_mask)];
+		__atomic_store_n(head, *head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
 };
+#endif
 
-//Functions Declarations
-void setEnvironmentVariables(EnvironmentVariables* env);
-void loadImages(cimg_library::CImgList<unsigned char>* list,EnvironmentVariables* env);
-void parseArgs(int argc, char* argv[], EnvironmentVariables* env);
-void drawOverlay(cimg_library::CImg<unsigned char> *concImage, cimg_library::CImg<unsigned char> *drawImage, EnvironmentVariables* env);
-void calcBinnedThickness(cimg_library::CImg<unsigned char> *concImage, cimg_library::CImg<unsigned char> *biofilmImage, EnvironmentVariables* env);
-void drawAt(cimg_library::CImg<unsigned char> *image, int x, int y, int R, int G, int B, int size, EnvironmentVariables* env);
-void iniInput(std::string iniFile, EnvironmentVariables* env);
-float getConcValue(cimg_library::CImg<unsigned char> *image, int x, int y);
-cimg_library::CImg<unsigned char> calcBiofilm(cimg_library::CImgList<unsigned char>* list, EnvironmentVariables* env, bool isDisp);
-cimg_library::CImg<unsigned char> calcConcentrationGradient(cimg_library::CImgList<unsigned char>* list, EnvironmentVariables* env);
-colour getHeatmapColour(int val);
-
-int main(int argc, char* argv[])
-{
-	/////////////////////////////////////////////////////////////////////////////////
-	//SET UP ENVIRONMENT
-		//Create the environment variables for this analysis
-		EnvironmentVariables env;
-
-		//Parse command line args, setting most environment variables
-		parseArgs(argc, argv, &env);
-	
-		//Verify that environment variables are correct, then set file names for analysis	
-		try {
-			if (env.VERBOSE)
-				std::cout << "Examining ini file..." << std::endl;
-			iniInput("exma.ini", &env);
-			if (env.VERBOSE)
-				std::cout << "Examining images..." << std::endl;
-			setEnvironmentVariables(&env);
+void LayerReadAhead::start(const std::vector<std::string>* fileNames, int readWindow, bool verbose)
+{
+	stop();
+	names = fileNames;
+	window = std::max(1, std::min(readWindow, int(names->size()))); //No more files can be in flight than there are
+	contents.assign(names->size(), std::vector<unsigned char>());
+	states.assign(names->size(), PENDING);
+	nextLayer = firstUntaken = 0;
+	stopping = false;
+
+#ifdef EXMA_IO_URING
+	ring = new IoRing;
+	if (ring->open(unsigned(window)))
+	{
+		if (verbose)
+			std::cout << "Reading up to " << window << " layers ahead with io_uring" << std::endl;
+		workers.emplace_back(&LayerReadAhead::ringThread, this);
+		return;
+	}
+	delete ring;
+	ring = nullptr;
+#endif
+
+	//Reading threads mostly wait on the device, so there is one per file in flight rather than one per core, up to a limit past which
+	//more threads only add contention (the window can still be larger, the files are then read a few threads' worth at a time)
+	const int threads = std::min(window, 64);
+	if (verbose)
+		std::cout << "Reading up to " << window << " layers ahead with " << threads << " threads" << std::endl;
+	for (int thread = 0; thread < threads; thread++)
+		workers.emplace_back(&LayerReadAhead::readThread, this);
+}
+
+bool LayerReadAhead::take(int layer, std::vector<unsigned char>* fileContents)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [&] { return states[layer] != PENDING; });
+
+	const bool read = states[layer] == READ;
+	*fileContents = std::move(contents[layer]);
+	states[layer] = TAKEN;
+	while (firstUntaken < int(states.size()) && states[firstUntaken] == TAKEN)
+		firstUntaken++;
+	changed.notify_all();
+	return read;
+}
+
+void LayerReadAhead::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	changed.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+	workers.clear();
+
+#ifdef EXMA_IO_URING
+	delete ring;
+#endif
+	ring = nullptr;
+	contents.clear();
+	states.clear();
+}
+
+void LayerReadAhead::finish(int layer, bool read, std::vector<unsigned char>* fileContents)
+{
+	contents[layer] = std::move(*fileContents);
+	states[layer] = read ? READ : FAILED;
+	changed.notify_all();
+}
+
+void LayerReadAhead::readThread()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		changed.wait(guard, [&] { return stopping || nextLayer >= int(states.size()) || canRead(); });
+		if (stopping || nextLayer >= int(states.size()))
+			return;
+
+		const int layer = nextLayer++;
+		guard.unlock();
+		std::vector<unsigned char> fileContents;
+		std::ifstream file((*names)[layer], std::ios::binary | std::ios::ate);
+		bool read = false;
+		if (file)
+		{
+			const std::streamoff size = file.tellg();
+			if (size > 0)
+			{
+				fileContents.resize(size_t(size));
+				file.seekg(0);
+				read = bool(file.read((char*)fileContents.data(), size));
+			}
 		}
-		catch (const char* msg) {
-			std::cerr << msg << std::endl;
-			return 0;
+		guard.lock();
+		finish(layer, read, &fileContents);
+	}
+}
+
+void LayerReadAhead::ringThread()
+{
+#ifdef EXMA_IO_URING
+	//Each file is read in as many pieces as the kernel needs, so the state of every read in flight is kept until it is complete
+	struct Read
+	{
+		int file = -1;
+		std::vector<unsigned char> contents;
+		iovec buffer = {};
+	};
+	std::vector<Read> reads(states.size());
+	int inFlight = 0;
+
+	auto queueRest = [&](int layer) {
+		Read& read = reads[layer];
+		const size_t done = size_t((unsigned char*)read.buffer.iov_base - read.contents.data());
+		ring->queueRead(read.file, &read.buffer, done, uint64_t(layer));
+	};
+
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		//Open every file that fits in the window and queue its first read
+		while (!stopping && canRead())
+		{
+			const int layer = nextLayer++;
+			guard.unlock();
+			Read& read = reads[layer];
+			read.file = ::open((*names)[layer].c_str(), O_RDONLY);
+			struct stat fileStat;
+			if (read.file >= 0 && fstat(read.file, &fileStat) == 0 && fileStat.st_size > 0)
+			{
+				read.contents.resize(size_t(fileStat.st_size));
+				read.buffer = { read.contents.data(), read.contents.size() };
+				queueRest(layer);
+				inFlight++;
+				guard.lock();
+				continue;
+			}
+			if (read.file >= 0)
+				::close(read.file);
+			read.file = -1;
+			guard.lock();
+			finish(layer, false, &read.contents);
 		}
 
-		//Make the list of images representing each vertical slice of the 3D data
-		cimg_library::CImgList<unsigned char> imageList;
-	
-		//Verify that environment variables are correct and load each image into the list
-		try {
-			if (env.VERBOSE)
-				std::cout << "Loading Images..." << std::endl;
-			loadImages(&imageList, &env);
+		if (inFlight == 0)
+		{
+			if (stopping || nextLayer >= int(states.size()))
+				return;
+			changed.wait(guard);
+			continue;
+		}
+
+		//Reads still in flight are always waited for, since the kernel writes into their buffers
+		guard.unlock();
+		if (!ring->submitAndWait())
+		{
+			//The ring is unusable, but the kernel still writes into the buffers of the reads it was given. Every read in flight has one
+			//entry in the ring, and those not yet submitted never will be, so only the rest are waited for before the buffers are freed
+			int submitted = inFlight - int(ring->queued);
+			io_uring_cqe completion;
+			while (submitted > 0 && ring->wait())
+			{
+				while (ring->complete(&completion))
+					submitted--;
+			}
+			for (Read& read : reads)
+			{
+				if (read.file >= 0)
+					::close(read.file);
+			}
+
+			//If even waiting fails, the buffers and the ring are left to the kernel rather than freed under it
+			guard.lock();
+			if (submitted > 0)
+			{
+				new std::vector<Read>(std::move(reads));
+				ring = nullptr;
+			}
+
+			//Every file not read yet is left for the loader to map, and the buffers of the reads cut short are not handed out
+			std::vector<unsigned char> none;
+			for (int layer = 0; layer < int(states.size()); layer++)
+			{
+				if (states[layer] == PENDING)
+					finish(layer, false, &none);
+			}
+			nextLayer = int(states.size());
+			changed.wait(guard, [&] { return stopping; });
+			return;
+		}
+
+		io_uring_cqe completion;
+		guard.lock();
+		while (ring->complete(&completion))
+		{
+			const int layer = int(completion.user_data);
+			Read& read = reads[layer];
+			if (completion.res == -EINTR || completion.res == -EAGAIN)
+			{
+				queueRest(layer);
+				continue;
+			}
+			if (completion.res > 0)
+			{
+				read.buffer.iov_base = (unsigned char*)read.buffer.iov_base + completion.res;
+				read.buffer.iov_len -= size_t(completion.res);
+				if (read.buffer.iov_len > 0)
+				{
+					queueRest(layer);
+					continue;
+				}
+			}
+
+			//Complete, or failed (an error, or the file became shorter)
+			::close(read.file);
+			read.file = -1;
+			inFlight--;
+			finish(layer, completion.res > 0, &read.contents);
+		}
+	}
+#endif
+}
+
+template<typename Sample>
+const Sample* Layer<Sample>::row(int y, Sample* buffer) const
+{
+	if (tiff)
+	{
+		//Single-sample 8-bit pages can be read in place
+		if (sizeof(Sample) == 1 && tiff->BITS == 8 && tiff->SAMPLES == 1)
+			return (const Sample*)tiff->rowData(page, y);
+		tiff->readRow(page, y, sample, buffer);
+		return buffer;
+	}
+
+	if (!mapped.isOpen())
+		return image.data(0, y - rowOffset);
+
+	const unsigned char* src = mapped.row(y);
+	if (mapped.BITS == 8)
+	{
+		for (int x = 0; x < mapped.WIDTH; x++)
+			buffer[x] = mapped.palette[src[x]];
+	}
+	else
+	{
+		src += mapped.channelOffset;
+		for (int x = 0; x < mapped.WIDTH; x++)
+			buffer[x] = src[x * 3];
+	}
+	return buffer;
+}
+
+//Copy rows [firstRow, endRow) of a layer read from a mapping into its own image, so it can be modified and no longer needs the mapping
+template<typename Sample>
+void detachLayer(Layer<Sample>* layer, int firstRow, int endRow, EnvironmentVariables* env)
+{
+	if (!layer->tiff && !layer->mapped.isOpen())
+		return;
+
+	layer->image.assign(env->WIDTH, endRow - firstRow, 1, 1);
+	for (int i = firstRow; i < endRow; i++)
+	{
+		Sample* out = layer->image.data(0, i - firstRow);
+		const Sample* in = layer->row(i, out);
+		if (in != out)
+			std::copy(in, in + env->WIDTH, out);
+	}
+	layer->rowOffset = firstRow;
+	layer->tiff = nullptr;
+	layer->mapped.close();
+}
+
+//Standard deviations of the --smooth_3d Gaussian, given in micrometers: in pixels across each layer, and in layers along z
+float smoothingSigmaXY(EnvironmentVariables* env)
+{
+	return env->SMOOTH_3D > 0 ? env->SMOOTH_3D / env->PIXEL_WIDTH : 0.f;
+}
+
+float smoothingSigmaZ(EnvironmentVariables* env)
+{
+	return env->SMOOTH_3D > 0 ? env->SMOOTH_3D / env->LAYER_THICKNESS : 0.f;
+}
+
+//Layers on either side of a layer that its smoothed value is taken from; the Gaussian is cut off three standard deviations out
+int smoothingRadius(EnvironmentVariables* env)
+{
+	return env->SMOOTH_3D > 0 ? int(std::ceil(3.f * smoothingSigmaZ(env))) : 0;
+}
+
+//Layers are median filtered, blurred or smoothed, and so always copied out of their files, before they are used
+bool filteredLayers(EnvironmentVariables* env)
+{
+	return env->LAYER_MEDIAN > 0 || env->LAYER_BLUR > 0 || env->SMOOTH_3D > 0;
+}
+
+//Rows the filters read beyond a band of rows: the median radius, and for the blur ten standard deviations, since the recursive
+//filter decays as exp(-1.695 * distance / sigma) and that far away the difference to blurring the whole layer is far below one level
+int blurHalo(EnvironmentVariables* env)
+{
+	return std::max(0, env->LAYER_MEDIAN) + (env->LAYER_BLUR > 0 ? 10 * env->LAYER_BLUR : 0) + int(std::ceil(10.f * smoothingSigmaXY(env)));
+}
+
+//Run CImg's order 0 Deriche filter along lines of N samples held side by side: sample m of lane x is data[m * stride + x]
+//Every lane keeps its own filter state, so the loops over lanes have no dependencies and the compiler vectorizes them
+//store(n, line, filtered) is called once per line n, last line first: line points at the line's lanes in data and filtered at the lanes filtered values
+template<typename Sample, typename Store>
+void dericheLanes(Sample* data, size_t stride, int lanes, int N, float sigma, Store store)
+{
+	//Coefficients of CImg::deriche(), computed the same way so the results match it bit for bit
+	const float
+		alpha = 1.695f/sigma,
+		ema = (float)std::exp(-alpha),
+		ema2 = (float)std::exp(-2*alpha),
+		b1 = -2*ema,
+		b2 = ema2,
+		k = (1-ema)*(1-ema)/(1 + 2*alpha*ema-ema2),
+		a0 = k,
+		a1 = k*(alpha - 1)*ema,
+		a2 = k*(alpha + 1)*ema,
+		a3 = -k*ema2,
+		coefp = (a0 + a1)/(1 + b1 + b2),
+		coefn = (a2 + a3)/(1 + b1 + b2);
+
+	std::vector<float> Y(size_t(N) * lanes), yp(lanes), yb(lanes);
+	std::vector<Sample> xp(lanes), xa(lanes);
+
+	//Causal pass into Y
+	for (int x = 0; x < lanes; x++)
+	{
+		xp[x] = data[x];
+		yb[x] = yp[x] = coefp*xp[x];
+	}
+	for (int m = 0; m < N; m++)
+	{
+		const Sample* line = data + m * stride;
+		float* Ym = &Y[size_t(m) * lanes];
+		for (int x = 0; x < lanes; x++)
+		{
+			const Sample xc = line[x];
+			const float yc = Ym[x] = a0*xc + a1*xp[x] - b1*yp[x] - b2*yb[x];
+			xp[x] = xc; yb[x] = yp[x]; yp[x] = yc;
+		}
+	}
+
+	//Anti-causal pass, added to Y and rounded to Sample. xp, yp and yb now hold CImg's xn, yn and ya
+	for (int x = 0; x < lanes; x++)
+	{
+		xp[x] = xa[x] = data[(N - 1) * stride + x];
+		yp[x] = yb[x] = coefn*xp[x];
+	}
+	for (int n = N - 1; n >= 0; n--)
+	{
+		Sample* line = data + n * stride;
+		float* Yn = &Y[size_t(n) * lanes];
+		for (int x = 0; x < lanes; x++)
+		{
+			const Sample xc = line[x];
+			const float yc = a2*xp[x] + a3*xa[x] - b1*yp[x] - b2*yb[x];
+			xa[x] = xp[x]; xp[x] = xc; yb[x] = yp[x]; yp[x] = yc;
+			Yn[x] += yc;
+		}
+		store(n, line, Yn);
+	}
+}
+
+//Horizontal pass of blurLayer, filtering blocks of 16 rows side by side after transposing them
+template<typename Sample>
+void blurRows(cimg_library::CImg<Sample>* image, float sigma)
+{
+	const int width = image->width(), height = image->height();
+	Sample* data = image->data();
+
+	if (width > 1)
+	{
+		const int block = 16;
+		std::vector<Sample> lines(size_t(width) * block);
+		for (int first = 0; first < height; first += block)
+		{
+			const int rows = std::min(block, height - first);
+			for (int r = 0; r < rows; r++)
+			{
+				const Sample* row = data + size_t(first + r) * width;
+				for (int m = 0; m < width; m++)
+					lines[size_t(m) * block + r] = row[m];
+			}
+			dericheLanes(lines.data(), block, rows, width, sigma, [&](int /*n*/, Sample* line, const float* Yn) {
+				for (int r = 0; r < rows; r++)
+					line[r] = (Sample)Yn[r];
+			});
+			for (int r = 0; r < rows; r++)
+			{
+				Sample* row = data + size_t(first + r) * width;
+				for (int m = 0; m < width; m++)
+					row[m] = lines[size_t(m) * block + r];
+			}
+		}
+	}
+
+}
+
+//Blur a single-channel layer exactly as CImg's blur() does (a Deriche recursive filter along x and then along y, rounding to Sample
+//in between), so the cost does not depend on sigma. The vertical pass runs down strips of 64 columns, reading whole rows rather than
+//striding down one column at a time
+template<typename Sample>
+void blurLayer(cimg_library::CImg<Sample>* image, float sigma)
+{
+	if (image->is_empty() || sigma < 0.1f)
+		return;
+	blurRows(image, sigma);
+
+	const int width = image->width(), height = image->height();
+	if (height > 1)
+	{
+		for (int first = 0; first < width; first += 64)
+		{
+			const int lanes = std::min(64, width - first);
+			dericheLanes(image->data() + first, size_t(width), lanes, height, sigma, [&](int /*n*/, Sample* line, const float* Yn) {
+				for (int x = 0; x < lanes; x++)
+					line[x] = (Sample)Yn[x];
+			});
+		}
+	}
+}
+
+//Blur a layer as blurLayer does and threshold it in the same pass, keeping only a bit per pixel (set above threshold) in mask:
+//bit x % 64 of word x / 64 of each row. The blurred values of the vertical pass are thresholded as they come out of the filter,
+//so the blurred layer is never written back; each strip of 64 columns fills one word of every row
+template<typename Sample>
+void blurThreshold(cimg_library::CImg<Sample>* image, float sigma, int threshold, std::vector<uint64_t>* mask)
+{
+	const int width = image->width(), height = image->height(), words = (width + 63) / 64;
+	mask->assign(size_t(height) * words, 0);
+	if (image->is_empty())
+		return;
+	if (sigma >= 0.1f)
+		blurRows(image, sigma);
+
+	for (int first = 0; first < width; first += 64)
+	{
+		const int lanes = std::min(64, width - first);
+		auto store = [&](int n, Sample* /*line*/, const float* Yn) {
+			//Compare into bytes first, which vectorizes, and pack them into the word afterwards
+			unsigned char above[64] = {};
+			for (int x = 0; x < lanes; x++)
+				above[x] = (Sample)Yn[x] > threshold;
+			uint64_t bits = 0;
+			for (int x = 0; x < 64; x++)
+				bits |= uint64_t(above[x]) << x;
+			(*mask)[size_t(n) * words + first / 64] = bits;
+		};
+
+		if (height > 1 && sigma >= 0.1f)
+			dericheLanes(image->data() + first, size_t(width), lanes, height, sigma, store);
+		else
+		{
+			for (int n = 0; n < height; n++)
+			{
+				const Sample* line = image->data() + size_t(n) * width + first;
+				uint64_t bits = 0;
+				for (int x = 0; x < lanes; x++)
+					bits |= uint64_t(line[x] > threshold) << x;
+				(*mask)[size_t(n) * words + first / 64] = bits;
+			}
+		}
+	}
+}
+
+template void blurThreshold<unsigned char>(cimg_library::CImg<unsigned char>* image, float sigma, int threshold, std::vector<uint64_t>* mask);
+template void blurThreshold<uint16_t>(cimg_library::CImg<uint16_t>* image, float sigma, int threshold, std::vector<uint64_t>* mask);
+
+template void blurLayer<unsigned char>(cimg_library::CImg<unsigned char>* image, float sigma);
+template void blurLayer<uint16_t>(cimg_library::CImg<uint16_t>* image, float sigma);
+
+//Median of the (2 * radius + 1)^2 window around each pixel of rows [firstRow, endRow), with the edge pixels repeated beyond the layer
+//This is Perreault and Hebert's constant time median: a histogram of each column of the window is kept and moved down a row at a time,
+//and the window's histogram slides along the row by adding the column entering it and removing the one leaving it. The window keeps
+//16 coarse bins (of the top four bits) up to date, and the 16 fine bins under a coarse bin are only brought up to date when the median
+//falls in it, which is usually the bin it fell in at the last pixel. So the cost per pixel does not depend on the radius
+//The rows are worked through in strips a few windows wide, so the column histograms being moved down stay in cache
+void medianRows(const cimg_library::CImg<unsigned char>& image, int radius, int firstRow, int endRow, cimg_library::CImg<unsigned char>* median)
+{
+	const int width = image.width(), height = image.height(), diameter = 2 * radius + 1, half = diameter * diameter / 2;
+	auto clampRow = [&](int y) { return std::min(std::max(y, 0), height - 1); };
+	auto clampColumn = [&](int x) { return std::min(std::max(x, 0), width - 1); };
+
+	//Fine bins 0 to 255 and then coarse bins 256 to 271 of each column of the strip, including the columns the window reaches past
+	//its sides, so the columns are never clamped while sliding along a row
+	const int bins = 256 + 16, padding = radius + 1, stripWidth = std::max(64, 8 * diameter);
+	std::vector<uint16_t> columns(size_t(stripWidth + 2 * padding) * bins);
+	for (int firstColumn = 0; firstColumn < width; firstColumn += stripWidth)
+	{
+		const int endColumn = std::min(width, firstColumn + stripWidth);
+		auto moveRow = [&](int y, int change) {
+			const unsigned char* row = image.data(0, clampRow(y));
+			for (int x = firstColumn - padding; x < endColumn + padding; x++)
+			{
+				const unsigned char value = row[clampColumn(x)];
+				columns[size_t(x - firstColumn + padding) * bins + value] += change;
+				columns[size_t(x - firstColumn + padding) * bins + 256 + (value >> 4)] += change;
+			}
+		};
+		auto column = [&](int x) { return &columns[size_t(x - firstColumn + padding) * bins]; };
+		std::fill(columns.begin(), columns.end(), 0);
+		for (int y = firstRow - radius; y <= firstRow + radius; y++)
+			moveRow(y, 1);
+
+		uint16_t coarse[16], fine[256];
+		int fineAt[16]; //Pixel each coarse bin's fine bins were last brought up to date for
+		for (int y = firstRow; y < endRow; y++)
+		{
+			if (y > firstRow)
+			{
+				moveRow(y - radius - 1, -1);
+				moveRow(y + radius, 1);
+			}
+
+			std::fill(coarse, coarse + 16, 0);
+			for (int x = firstColumn - radius; x <= firstColumn + radius; x++)
+			{
+				for (int c = 0; c < 16; c++)
+					coarse[c] += column(x)[256 + c];
+			}
+			std::fill(fineAt, fineAt + 16, firstColumn - diameter - 1);
+
+			unsigned char* dst = median->data(0, y);
+			for (int x = firstColumn; x < endColumn; x++)
+			{
+				int below = 0, c = 0;
+				while (below + coarse[c] <= half)
+					below += coarse[c++];
+
+				//Slide the fine bins of c along from where they were left, or sum them afresh when that is further than the window is wide
+				uint16_t* bin = &fine[c * 16];
+				if (x - fineAt[c] > diameter)
+				{
+					std::fill(bin, bin + 16, 0);
+					for (int dx = -radius; dx <= radius; dx++)
+					{
+						const uint16_t* counts = column(x + dx) + c * 16;
+						for (int b = 0; b < 16; b++)
+							bin[b] += counts[b];
+					}
+				}
+				else
+				{
+					for (int step = fineAt[c] + 1; step <= x; step++)
+					{
+						const uint16_t* entering = column(step + radius) + c * 16;
+						const uint16_t* leaving = column(step - radius - 1) + c * 16;
+						for (int b = 0; b < 16; b++)
+							bin[b] += entering[b] - leaving[b];
+					}
+				}
+				fineAt[c] = x;
+
+				int b = 0;
+				while (below + bin[b] <= half)
+					below += bin[b++];
+				dst[x] = (unsigned char)(c * 16 + b);
+
+				const uint16_t* entering = column(x + radius + 1) + 256;
+				const uint16_t* leaving = column(x - radius) + 256;
+				for (int c = 0; c < 16; c++)
+					coarse[c] += entering[c] - leaving[c];
+			}
+		}
+	}
+}
+
+//16-bit samples have too many levels for a histogram per column, so this is Huang's median instead: a single histogram of the window
+//slides along each row, adding the column entering it and removing the one leaving it, so the cost per pixel grows with the radius
+//rather than with its square. The median and the count of pixels below it are kept up to date and walked to the new median from the
+//last one, skipping over whole coarse bins (of the top eight bits) it does not fall in
+void medianRows(const cimg_library::CImg<uint16_t>& image, int radius, int firstRow, int endRow, cimg_library::CImg<uint16_t>* median)
+{
+	const int width = image.width(), height = image.height(), diameter = 2 * radius + 1, half = diameter * diameter / 2;
+	std::vector<uint32_t> fine(65536), coarse(256);
+	std::vector<const uint16_t*> rows(diameter);
+	int level = 0, below = 0; //Median of the window and the count of its pixels below it
+	auto moveColumn = [&](int x, int change) {
+		x = std::min(std::max(x, 0), width - 1);
+		for (const uint16_t* row : rows)
+		{
+			const uint16_t value = row[x];
+			fine[value] += change;
+			coarse[value >> 8] += change;
+			if (value < level)
+				below += change;
+		}
+	};
+
+	for (int y = firstRow; y < endRow; y++)
+	{
+		for (int dy = -radius; dy <= radius; dy++)
+			rows[dy + radius] = image.data(0, std::min(std::max(y + dy, 0), height - 1));
+		level = below = 0;
+		for (int x = -radius; x <= radius; x++)
+			moveColumn(x, 1);
+
+		uint16_t* dst = median->data(0, y);
+		for (int x = 0; x < width; x++)
+		{
+			if (x > 0)
+			{
+				moveColumn(x - radius - 1, -1);
+				moveColumn(x + radius, 1);
+			}
+
+			while (below > half)
+			{
+				while (level % 256 == 0 && below - int(coarse[level / 256 - 1]) > half)
+				{
+					level -= 256;
+					below -= coarse[level / 256];
+				}
+				below -= fine[--level];
+			}
+			while (below + int(fine[level]) <= half)
+			{
+				below += fine[level++];
+				while (level % 256 == 0 && below + int(coarse[level / 256]) <= half)
+				{
+					below += coarse[level / 256];
+					level += 256;
+				}
+			}
+			dst[x] = (uint16_t)level;
+		}
+
+		//Empty the histogram again for the next row
+		for (int x = width - 1 - radius; x <= width - 1 + radius; x++)
+			moveColumn(x, -1);
+	}
+}
+
+//Replace each pixel of a single-channel layer by the median of the (2 * radius + 1)^2 window around it, with the rows split between threads
+template<typename Sample>
+void medianLayer(cimg_library::CImg<Sample>* image, int radius, int threads)
+{
+	if (image->is_empty() || radius <= 0)
+		return;
+	cimg_library::CImg<Sample> median(image->width(), image->height());
+	parallelRows(image->height(), threads, [&](int first, int end, int /*band*/) {
+		medianRows(*image, radius, first, end, &median);
+	});
+	image->swap(median);
+}
+
+template void medianLayer<unsigned char>(cimg_library::CImg<unsigned char>* image, int radius, int threads);
+template void medianLayer<uint16_t>(cimg_library::CImg<uint16_t>* image, int radius, int threads);
+
+//Weights of the layers from -smoothingRadius to +smoothingRadius around a smoothed layer, summing to one
+std::vector<float> smoothingWeights(EnvironmentVariables* env)
+{
+	const int radius = smoothingRadius(env);
+	const float sigma = smoothingSigmaZ(env);
+	std::vector<float> weights(2 * radius + 1);
+	float sum = 0.f;
+	for (int k = -radius; k <= radius; k++)
+		sum += weights[k + radius] = std::exp(-0.5f * float(k * k) / (sigma * sigma));
+	for (float& weight : weights)
+		weight /= sum;
+	return weights;
+}
+
+//Smooth rows [firstRow, endRow) of layer z along z, as the weighted sum of the layers around it rounded to Sample, with the first
+//and last layers repeated beyond the stack. window[k % window.size()] holds layer k, already smoothed across the layer. With
+//thresholded only the mask of the result is kept. The rows are split between the threads
+template<typename Sample>
+void smoothDepth(const std::vector<Layer<Sample>>& window, int z, const std::vector<float>& weights, int firstRow, int endRow, bool thresholded, EnvironmentVariables* env, Layer<Sample>* out)
+{
+	const int radius = int(weights.size()) / 2, width = env->WIDTH, words = (width + 63) / 64;
+	out->rowOffset = firstRow;
+	if (thresholded)
+	{
+		out->image.assign();
+		out->mask.assign(size_t(endRow - firstRow) * words, 0);
+		out->maskWords = words;
+	}
+	else
+	{
+		out->mask.clear();
+		out->image.assign(width, endRow - firstRow);
+	}
+
+	parallelRows(endRow - firstRow, env->THREADS, [&](int first, int end, int /*band*/) {
+		std::vector<float> sum(width);
+		for (int i = firstRow + first; i < firstRow + end; i++)
+		{
+			std::fill(sum.begin(), sum.end(), 0.f);
+			for (int k = -radius; k <= radius; k++)
+			{
+				const int layer = std::min(std::max(z + k, 0), env->DEPTH - 1);
+				const Sample* src = window[layer % window.size()].row(i, nullptr);
+				const float weight = weights[k + radius];
+				for (int x = 0; x < width; x++)
+					sum[x] += weight * float(src[x]);
+			}
+
+			if (thresholded)
+			{
+				uint64_t* bits = &out->mask[size_t(i - firstRow) * words];
+				for (int x = 0; x < width; x++)
+					bits[x / 64] |= uint64_t((Sample)(sum[x] + 0.5f) > env->THRESHOLD) << (x % 64);
+			}
+			else
+			{
+				Sample* dst = out->image.data(0, i - firstRow);
+				for (int x = 0; x < width; x++)
+					dst[x] = (Sample)(sum[x] + 0.5f);
+			}
+		}
+	});
+}
+
+//Read rows [firstRow, endRow) of the layer straight from the TIFF stack or a mapped BMP when possible, otherwise decode it with CImg
+template<typename Sample>
+void loadLayer(int layerIndex, const TiffStack* tiff, LayerReadAhead* readAhead, int firstRow, int endRow, bool thresholded, EnvironmentVariables* env, Layer<Sample>* layer)
+{
+	//Blurred rows depend on their neighbours, so the rows around the band are blurred with it
+	firstRow = std::max(0, firstRow - blurHalo(env));
+	endRow = std::min(env->HEIGHT, endRow + blurHalo(env));
+
+	//The median comes first, so dead pixels are removed before they can be blurred into their neighbours
+	//When only the thresholded layer is needed, it is blurred and thresholded in one pass and only its mask is kept
+	//The --smooth_3d Gaussian across the layer follows the blur; the layer is smoothed along z once its neighbours are loaded
+	//Layers are loaded one per thread, so each is filtered on a single thread
+	const bool filtered = filteredLayers(env);
+	auto blur = [&]() {
+		medianLayer(&layer->image, env->LAYER_MEDIAN, 1);
+		if (thresholded)
+		{
+			blurThreshold(&layer->image, float(env->LAYER_BLUR), env->THRESHOLD, &layer->mask);
+			layer->maskWords = (env->WIDTH + 63) / 64;
+			layer->image.assign();
 		}
-		catch (const char* msg) {
-			std::cerr << msg << std::endl;
-			return 0;
+		else
+		{
+			blurLayer(&layer->image, float(env->LAYER_BLUR));
+			blurLayer(&layer->image, smoothingSigmaXY(env));
 		}
+	};
 
-		//Folder for outputs
-		if (!fs::is_directory(env.imageFolderName + "_exma_analysis") || !fs::exists(env.imageFolderName + "_exma_analysis"))
+	layer->tiff = nullptr;
+	layer->rowOffset = 0;
+	layer->mask.clear();
+	if (tiff)
+	{
+		//The channel is either a sample of each pixel or a separate set of pages
+		layer->mapped.close();
+		layer->tiff = tiff;
+		layer->page = tiff->page(layerIndex, tiff->CHANNELS > 1 ? env->CHANNEL : 0);
+		layer->sample = tiff->SAMPLES > 1 ? env->CHANNEL : 0;
+	}
+	else
+	{
+		//A file that was read ahead is used from memory, anything else is mapped
+		const std::string& imageName = env->imageFileNames[layerIndex];
+		std::vector<unsigned char> fileContents;
+		const bool mapped = (readAhead && readAhead->take(layerIndex, &fileContents)) ? layer->mapped.open(std::move(fileContents), env->CHANNEL) : layer->mapped.open(imageName, env->CHANNEL);
+		if (!mapped)
 		{
-			if (env.VERBOSE)
-				std::cout << "Creating output folder..." << std::endl;
-			fs::create_directory(env.imageFolderName + "_exma_analysis"); // create src folder
+			//Only the whole layer can be decoded, but only the band is kept
+			layer->image = decodeLayer(imageName, env);
+			if (firstRow > 0 || endRow < env->HEIGHT)
+			{
+				layer->image.crop(0, firstRow, env->WIDTH - 1, endRow - 1);
+				layer->rowOffset = firstRow;
+			}
+			if (filtered)
+				blur();
+			return;
 		}
-	/////////////////////////////////////////////////////////////////////////////////
 
-	/////////////////////////////////////////////////////////////////////////////////
-	//If concentration gradient is needed, prompt user to click mixing point
-		if (env.A_CONCENTRATION)
+		if (layer->mapped.WIDTH != env->WIDTH || layer->mapped.HEIGHT != env->HEIGHT)
 		{
-			std::cout << "Please click on the mixing point (tip of the divider where two streams meet)" << std::endl;
+			layer->mapped.close();
+			throw "Inconsistent image dimensions: please check that all images in folder are the same dimensions";
+		}
+	}
 
-			cimg_library::CImgDisplay point_disp(imageList[0], "Please click on the mixing point");
+	//Blurring needs a copy of the channel to work on, but it can still be taken from the mapping rather than decoded
+	if (filtered)
+	{
+		detachLayer(layer, firstRow, endRow, env);
+		blur();
+	}
+}
 
-			point_disp.resize(env.DISP_WIDTH, env.DISP_HEIGHT, true);
+//Number of layers loaded at once: one per thread, or more for unfiltered TIFF pages since they are read in place
+int loadBatchSize(bool tiff, EnvironmentVariables* env)
+{
+	return std::max(1, std::min(env->DEPTH, (tiff && !filteredLayers(env)) ? std::max(64, env->THREADS) : env->THREADS));
+}
 
-			static bool point_selected = false;
+//Most layers loadLayers holds at once: two batches, and with --smooth_3d the window of layers around the one being smoothed
+//and a batch of smoothed layers
+int loadedLayers(bool tiff, EnvironmentVariables* env)
+{
+	const int batchSize = loadBatchSize(tiff, env);
+	return 2 * batchSize + (env->SMOOTH_3D > 0 ? 2 * smoothingRadius(env) + 1 + batchSize : 0);
+}
 
-			while (!point_disp.is_closed() && !point_selected) {
-				if (point_disp.button() & 1) { // Left button clicked
-					if (point_disp.mouse_x() >= 0 && point_disp.mouse_y() >= 0)
-					{
-						env.MIX_X = point_disp.mouse_x() / (float(env.DISP_PERCENT)*0.01f);
-						env.MIX_Y = point_disp.mouse_y() / (float(env.DISP_PERCENT)*0.01f);
+//Load rows [firstRow, endRow) of the layers in batches, then transpose each batch into the stack with the rows split between the threads
+//The next batch is loaded in the background while the current one is transposed, so at most two batches are held at once
+//scatter(batch, firstLayer, layers, firstRow, endRow) copies rows [firstRow, endRow) of the loaded layers into the stack
+//With --smooth_3d each loaded layer moves into a window of the 2 * smoothingRadius + 1 layers around the next one to smooth along z,
+//which is smoothed as soon as the last of them arrives; the smoothed layers are gathered into batches of their own for scatter
+template<typename Sample, typename Scatter>
+void loadLayers(const TiffStack* tiff, int firstRow, int endRow, bool thresholded, EnvironmentVariables* env, Scatter scatter)
+{
+	const int batchSize = loadBatchSize(tiff != nullptr, env);
+	std::vector<Layer<Sample>> batches[2] = { std::vector<Layer<Sample>>(batchSize), std::vector<Layer<Sample>>(batchSize) };
+	const bool smoothing = env->SMOOTH_3D > 0;
+	const std::vector<float> weights = smoothing ? smoothingWeights(env) : std::vector<float>();
+	std::vector<Layer<Sample>> window(weights.size()), smoothed(smoothing ? batchSize : 0);
+	std::vector<const char*> errors[2] = { std::vector<const char*>(batchSize), std::vector<const char*>(batchSize) };
+
+	//Whole layer files are read ahead of the batches, with at least the next batch in flight; a band of rows is mapped
+	//instead, since reading whole files would read every other band too. --stream and --mem_budget map every layer, since
+	//the files read ahead would be held on top of the memory those modes are bounded to
+	LayerReadAhead readAhead;
+	const bool readingAhead = !tiff && env->READ_AHEAD > 0 && !env->STREAM && env->MEM_BUDGET <= 0 && firstRow == 0 && endRow == env->HEIGHT;
+	if (readingAhead)
+		readAhead.start(&env->imageFileNames, std::max(env->READ_AHEAD, batchSize), env->VERBOSE);
+
+	//Exceptions cannot leave a worker thread, so they are held on to until the batch is used
+	auto loadBatch = [&](int firstLayer, int current) {
+		const int layers = std::min(batchSize, env->DEPTH - firstLayer);
+		if (env->VERBOSE)
+		{
+			for (int layer = firstLayer; layer < firstLayer + layers; layer++)
+			{
+				if (tiff)
+					std::cout << "Loading layer " << layer + 1 << " of " << env->imageFileNames[0] << std::endl;
+				else
+					std::cout << "Loading image: " << env->imageFileNames[layer] << std::endl;
+			}
+		}
 
-						if (env.MIX_X > env.WIDTH / 2)
-						{
-							env.FACING = true; //Inlet at right
-						}
-						else
-						{
-							env.FACING = false; //Inlet at left
-						}
-						point_selected = true;
-					}
+		parallelRows(layers, std::min(layers, env->THREADS), [&](int first, int end, int /*band*/) {
+			for (int l = first; l < end; l++)
+			{
+				errors[current][l] = nullptr;
+				try {
+					loadLayer(firstLayer + l, tiff, readingAhead ? &readAhead : nullptr, firstRow, endRow, thresholded && !smoothing, env, &batches[current][l]);
+				}
+				catch (const char* msg) {
+					errors[current][l] = msg;
+				}
+				catch (...) {
+					errors[current][l] = "Could not decode an image: please check that all images in folder are valid";
 				}
-				point_disp.wait();
 			}
-		}
-	/////////////////////////////////////////////////////////////////////////////////
+		});
+	};
 
-	/////////////////////////////////////////////////////////////////////////////////
-	//DO ANALYSIS AND COMPUTATIONS
-		
-		//Images to display for both
-		cimg_library::CImg<unsigned char> biofilm_image, concentration_image, display_image;
+	auto scatterBatch = [&](const std::vector<Layer<Sample>>& batch, int firstLayer, int layers) {
+		parallelRows(endRow - firstRow, env->THREADS, [&](int first, int end, int /*band*/) {
+			scatter(batch, firstLayer, layers, firstRow + first, firstRow + end);
+		});
+	};
 
-		//If concentration gradient needs to be calculated
-		if (env.A_CONCENTRATION)
+	loadBatch(0, 0);
+	for (int firstLayer = 0, current = 0, nextSmoothed = 0; firstLayer < env->DEPTH; firstLayer += batchSize, current ^= 1)
+	{
+		for (const char* msg : errors[current])
 		{
-			if (env.VERBOSE)
-				std::cout << "Calculating concentration gradient..." << std::endl;
-			concentration_image = calcConcentrationGradient(&imageList, &env);
+			if (msg)
+				throw msg;
 		}
 
-		//If biofilm thickness needs to be calculated
-		if (env.A_BIOFILM)
+		//Joined however the iteration is left, so an exception from scattering or smoothing cannot destroy a running thread
+		struct Prefetch
 		{
-			if (env.VERBOSE)
-				std::cout << "Calculating biofilm data..." << std::endl;
-			biofilm_image = calcBiofilm(&imageList, &env, false);
-			display_image = calcBiofilm(&imageList, &env, true);
+			std::thread thread;
+			~Prefetch() { if (thread.joinable()) thread.join(); }
+		} prefetch;
+		if (firstLayer + batchSize < env->DEPTH)
+			prefetch.thread = std::thread(loadBatch, firstLayer + batchSize, current ^ 1);
+
+		const int layers = std::min(batchSize, env->DEPTH - firstLayer);
+		if (!smoothing)
+			scatterBatch(batches[current], firstLayer, layers);
+		for (int l = 0; smoothing && l < layers; l++)
+		{
+			const int layer = firstLayer + l;
+			Layer<Sample>& slot = window[layer % window.size()];
+			slot.image.swap(batches[current][l].image);
+			slot.rowOffset = batches[current][l].rowOffset;
+
+			for (; nextSmoothed < env->DEPTH && (nextSmoothed + smoothingRadius(env) <= layer || layer == env->DEPTH - 1); nextSmoothed++)
+			{
+				smoothDepth(window, nextSmoothed, weights, firstRow, endRow, thresholded, env, &smoothed[nextSmoothed % batchSize]);
+				if (nextSmoothed % batchSize == batchSize - 1 || nextSmoothed == env->DEPTH - 1)
+					scatterBatch(smoothed, nextSmoothed / batchSize * batchSize, nextSmoothed % batchSize + 1);
+			}
 		}
+	}
+}
+
+//Header of the stack cache for the current inputs, recording everything the cached voxels depend on
+//A cache whose header differs in any way (a layer was added, replaced or touched, or another filter or channel was asked for) is stale
+std::string describeStackCache(EnvironmentVariables* env, size_t sampleBytes)
+{
+	std::string header = "EXMASTK1";
+	auto append = [&](int64_t value) { header.append((const char*)&value, sizeof(value)); };
+	append(env->WIDTH);
+	append(env->HEIGHT);
+	append(env->DEPTH);
+	append(int64_t(sampleBytes));
+	append(env->BIT_DEPTH);
+	append(env->CHANNEL);
+	append(env->LAYER_MEDIAN);
+	append(env->LAYER_BLUR);
+	append(std::lround(double(smoothingSigmaXY(env)) * 1e6));
+	append(std::lround(double(smoothingSigmaZ(env)) * 1e6));
+	append(int64_t(env->imageFileNames.size()));
+	for (const std::string& imageName : env->imageFileNames)
+	{
+		const std::string name = fs::path(imageName).filename().u8string();
+		append(int64_t(name.size()));
+		header += name;
+		append(int64_t(fs::file_size(imageName)));
+		append(int64_t(fs::last_write_time(imageName).time_since_epoch().count()));
+	}
+
+	//Pad so the voxels start on a cache line
+	header.resize((header.size() + 63) / 64 * 64, '\0');
+	return header;
+}
+
+//Map the stack straight from the stack cache, if it was written for exactly these inputs
+template<typename Sample>
+bool mapStackCache(VoxelStack<Sample>* stack, EnvironmentVariables* env)
+{
+	if (!stack->cache.open(env->imageFolderName + "_exma_analysis/stack.exc"))
+		return false;
+
+	const std::string header = describeStackCache(env, sizeof(Sample));
+	const size_t voxelBytes = size_t(env->WIDTH) * env->HEIGHT * env->DEPTH * sizeof(Sample);
+	if (stack->cache.size != header.size() + voxelBytes || memcmp(stack->cache.data, header.data(), header.size()) != 0)
+	{
+		stack->cache.close();
+		return false;
+	}
+
+	stack->WIDTH = env->WIDTH;
+	stack->HEIGHT = env->HEIGHT;
+	stack->DEPTH = env->DEPTH;
+	std::vector<Sample>().swap(stack->voxels);
+	stack->data = (const Sample*)(stack->cache.data + header.size());
+	return true;
+}
+
+template<typename Sample>
+void saveStackCache(const VoxelStack<Sample>& stack, EnvironmentVariables* env)
+{
+	const std::string path = env->imageFolderName + "_exma_analysis/stack.exc";
+	std::error_code error;
+	fs::create_directory(env->imageFolderName + "_exma_analysis", error);
+
+	//Write under a temporary name first, so an interrupted run never leaves a cache that looks complete
+	const std::string header = describeStackCache(env, sizeof(Sample));
+	std::ofstream file(path + ".tmp", std::ios::binary);
+	file.write(header.data(), header.size());
+	file.write((const char*)stack.data, size_t(stack.WIDTH) * stack.HEIGHT * stack.DEPTH * sizeof(Sample));
+	file.close();
+
+	if (file)
+		fs::rename(path + ".tmp", path, error);
+	if (!file || error)
+	{
+		fs::remove(path + ".tmp", error);
+		std::cout << "Could not write the stack cache " << path << std::endl;
+	}
+}
+
+//Otsu's threshold: the level that best separates the histogram into two classes, by the variance between them
+//Every threshold function returns the highest level of the background, or -1 when the histogram has fewer than two levels in it
+int otsuThreshold(const std::vector<uint64_t>& histogram)
+{
+	double total = 0., sum = 0.;
+	for (size_t level = 0; level < histogram.size(); level++)
+	{
+		total += double(histogram[level]);
+		sum += double(level) * double(histogram[level]);
+	}
 
-		//If table of data needs to be calculated
-		if (env.A_CONCENTRATION && env.TABLE && env.A_BIOFILM)
+	double background = 0., backgroundSum = 0., best = -1.;
+	int threshold = -1;
+	for (size_t level = 0; level + 1 < histogram.size(); level++)
+	{
+		background += double(histogram[level]);
+		backgroundSum += double(level) * double(histogram[level]);
+		const double foreground = total - background;
+		if (background == 0. || foreground == 0.)
+			continue;
+		const double difference = backgroundSum / background - (sum - backgroundSum) / foreground;
+		const double between = background * foreground * difference * difference;
+		if (between > best)
 		{
-			if (env.VERBOSE)
-				std::cout << "Exporting table: thickness vs. concentration..." << std::endl;
-			calcBinnedThickness(&concentration_image, &biofilm_image, &env);
+			best = between;
+			threshold = int(level);
 		}
+	}
+	return threshold;
+}
+
+//Zack's triangle threshold: the level furthest below the line from the histogram's peak to the far end of its longer tail
+int triangleThreshold(const std::vector<uint64_t>& histogram)
+{
+	int lowest = -1, highest = -1, peak = 0;
+	for (int level = 0; level < int(histogram.size()); level++)
+	{
+		if (histogram[level] == 0)
+			continue;
+		if (lowest < 0)
+			lowest = level;
+		highest = level;
+		if (histogram[level] > histogram[peak])
+			peak = level;
+	}
+	if (lowest == highest)
+		return -1;
+
+	//The histograms of 16-bit stacks are mostly empty levels between the occupied ones, which the line would dip to,
+	//so their occupied range is gathered into 256 bins first
+	if (histogram.size() > 256)
+	{
+		const int width = (highest - lowest) / 256 + 1;
+		std::vector<uint64_t> binned(256, 0);
+		for (int level = lowest; level <= highest; level++)
+			binned[(level - lowest) / width] += histogram[level];
+		const int threshold = triangleThreshold(binned);
+		return threshold < 0 ? -1 : lowest + (threshold + 1) * width - 1;
+	}
 
-		//If overlay needs to be calculated
-		if (env.OVERLAY && env.A_BIOFILM)
+	//The tail is usually the bright side, but a dark tail is followed the same way from the other end
+	const int end = (highest - peak >= peak - lowest) ? highest : lowest;
+	const double peakCount = double(histogram[peak]), endCount = double(histogram[end]);
+	const double side = end > peak ? 1. : -1.;
+	double furthest = 0.;
+	int threshold = peak;
+	for (int level = std::min(peak, end); level <= std::max(peak, end); level++)
+	{
+		//Positive below the line, for a tail on either side; levels above it (such as a second mode) never count
+		const double below = side * ((endCount - peakCount) * double(level - peak) - double(end - peak) * (double(histogram[level]) - peakCount));
+		if (below > furthest)
 		{
-			if (env.VERBOSE)
-				std::cout << "Adding overlay to display..." << std::endl;
-			drawOverlay(&concentration_image, &display_image, &env);
+			furthest = below;
+			threshold = level;
 		}
+	}
+	return threshold;
+}
+
+//Li's minimum cross entropy threshold, by the iteration of Li and Tam from the mean level, with the lowest level taken as zero
+int liThreshold(const std::vector<uint64_t>& histogram)
+{
+	int lowest = -1, highest = -1;
+	for (int level = 0; level < int(histogram.size()); level++)
+	{
+		if (histogram[level] == 0)
+			continue;
+		if (lowest < 0)
+			lowest = level;
+		highest = level;
+	}
+	if (lowest == highest)
+		return -1;
 
-		//Saving all data
-		if (env.SAVE)
+	//Mean of the levels in (from, to], measured from the lowest level
+	auto mean = [&](double from, double to) {
+		double count = 0., sum = 0.;
+		for (int level = lowest; level <= highest; level++)
 		{
-			if (env.VERBOSE)
-				std::cout << "Saving images..." << std::endl;
-			display_image.save_bmp((env.imageFolderName + "_exma_analysis/biofilm_display_image.bmp").c_str());
-			biofilm_image.save_bmp((env.imageFolderName + "_exma_analysis/biofilm_data.bmp").c_str());
+			if (level > from && level <= to)
+			{
+				count += double(histogram[level]);
+				sum += double(level - lowest) * double(histogram[level]);
+			}
 		}
+		return count > 0. ? sum / count : 0.;
+	};
 
-		if (env.VERBOSE)
-			std::cout << "Displaying final data..." << std::endl;		
+	double threshold = mean(lowest - 1, highest) + lowest, previous;
+	for (int iteration = 0; iteration < 1000; iteration++)
+	{
+		const double background = mean(lowest - 1, threshold), foreground = mean(threshold, highest);
+		if (background == 0. || foreground == 0.)
+			break;
+		previous = threshold;
+		threshold = (foreground - background) / (std::log(foreground) - std::log(background)) + lowest;
+		if (std::abs(threshold - previous) < 0.5)
+			break;
+	}
+	return int(std::floor(threshold));
+}
 
-		//Display the display image
-		if (env.DISPLAY && env.A_BIOFILM)
-		{
-			cimg_library::CImgDisplay main_disp(display_image, "Biofilm Thickness");
+//Set THRESHOLD by the --auto_threshold method from the histogram of the analysed channel over the whole stack,
+//keeping the -m threshold if the stack is a single level
+void selectThreshold(const std::vector<uint64_t>& histogram, EnvironmentVariables* env)
+{
+	int threshold = -1;
+	if (env->AUTO_THRESHOLD == "otsu")
+		threshold = otsuThreshold(histogram);
+	else if (env->AUTO_THRESHOLD == "triangle")
+		threshold = triangleThreshold(histogram);
+	else if (env->AUTO_THRESHOLD == "li")
+		threshold = liThreshold(histogram);
+	if (threshold >= 0)
+		env->THRESHOLD = threshold;
+
+	if (env->VERBOSE)
+		std::cout << "Threshold (" << env->AUTO_THRESHOLD << "): " << env->THRESHOLD << std::endl;
+}
 
-			main_disp.resize(env.DISP_WIDTH, env.DISP_HEIGHT, true);
+//Add one thread's counts to the histogram shared by every thread
+void mergeHistogram(const std::vector<uint64_t>& counts, std::vector<uint64_t>* histogram, std::mutex* merging)
+{
+	std::lock_guard<std::mutex> lock(*merging);
+	for (size_t level = 0; level < counts.size(); level++)
+		(*histogram)[level] += counts[level];
+}
 
-			while (!main_disp.is_closed()) {
-				main_disp.wait();
+//Histogram rows [firstRow, endRow) of the layers, for the loaders that threshold the layers as they load them and so need
+//the threshold before they start. Each thread counts its own rows and merges its counts at the end
+template<typename Sample>
+void histogramLayers(const TiffStack* tiff, int firstRow, int endRow, EnvironmentVariables* env, std::vector<uint64_t>* histogram)
+{
+	std::mutex merging;
+	loadLayers<Sample>(tiff, firstRow, endRow, false, env, [&](const std::vector<Layer<Sample>>& batch, int /*firstLayer*/, int layers, int first, int end) {
+		std::vector<uint64_t> counts(histogram->size(), 0);
+		std::vector<Sample> buffer(env->WIDTH);
+		for (int l = 0; l < layers; l++)
+		{
+			for (int i = first; i < end; i++)
+			{
+				const Sample* row = batch[l].row(i, buffer.data());
+				for (int j = 0; j < env->WIDTH; j++)
+					counts[row[j]]++;
 			}
 		}
+		mergeHistogram(counts, histogram, &merging);
+	});
+}
+
+//Choose THRESHOLD by --auto_threshold with a first pass over the layers, rows at a time so the pass stays within --mem_budget
+void thresholdLayers(const TiffStack* tiff, int rows, EnvironmentVariables* env)
+{
+	if (env->AUTO_THRESHOLD.empty())
+		return;
+	if (env->VERBOSE)
+		std::cout << "Choosing threshold..." << std::endl;
 
+	std::vector<uint64_t> histogram(size_t(1) << (env->BIT_DEPTH > 8 ? 16 : 8), 0);
+	for (int firstRow = 0; firstRow < env->HEIGHT; firstRow += rows)
+	{
+		const int endRow = std::min(env->HEIGHT, firstRow + rows);
+		if (env->BIT_DEPTH > 8)
+			histogramLayers<uint16_t>(tiff, firstRow, endRow, env, &histogram);
+		else
+			histogramLayers<unsigned char>(tiff, firstRow, endRow, env, &histogram);
+	}
+	selectThreshold(histogram, env);
 }
 
-//cxxopts implementation od a command line argument parser
-void parseArgs(int argc, char* argv[], EnvironmentVariables* env)
+//With --auto_threshold the stack keeps its intensities, so the histogram is counted while the layers are scattered into the stack
+//(or from the stack when it is read from the cache), and THRESHOLD is chosen from it once the stack is loaded
+template<typename Sample>
+void loadImages(VoxelStack<Sample>* stack, EnvironmentVariables* env)
 {
-	cxxopts::Options options("exma", "Analysis of extracelluar matrix and biofilm data");
+	initDimensions(env);
+
+	const bool counting = !env->AUTO_THRESHOLD.empty();
+	std::vector<uint64_t> histogram(counting ? size_t(1) << (8 * sizeof(Sample)) : 0, 0);
+	std::mutex merging;
+
+	if (env->CACHE && mapStackCache(stack, env))
+	{
+		if (env->VERBOSE)
+			std::cout << "Reading stack from cache..." << std::endl;
+		if (counting)
+		{
+			parallelRows(env->HEIGHT, env->THREADS, [&](int first, int end, int /*band*/) {
+				std::vector<uint64_t> counts(histogram.size(), 0);
+				const Sample* voxel = stack->data + size_t(first) * env->WIDTH * env->DEPTH;
+				for (size_t v = 0; v < size_t(end - first) * env->WIDTH * env->DEPTH; v++)
+					counts[voxel[v]]++;
+				mergeHistogram(counts, &histogram, &merging);
+			});
+			selectThreshold(histogram, env);
+		}
+		return;
+	}
+	stack->allocate(env->WIDTH, env->HEIGHT, env->DEPTH);
+
+	TiffStack tiff;
+	if (env->STACK_FILE)
+		tiff.open(env->imageFileNames[0]);
+
+	//Scatter the analysed channel into the z-columns and let the layers go
+	loadLayers<Sample>(env->STACK_FILE ? &tiff : nullptr, 0, env->HEIGHT, false, env, [&](const std::vector<Layer<Sample>>& batch, int firstLayer, int layers, int firstRow, int endRow) {
+		std::vector<const Sample*> rows(layers);
+		std::vector<Sample> buffers(size_t(layers) * env->WIDTH);
+		std::vector<uint64_t> counts(histogram.size(), 0);
+		for (int i = firstRow; i < endRow; i++)
+		{
+			for (int l = 0; l < layers; l++)
+				rows[l] = batch[l].row(i, &buffers[size_t(l) * env->WIDTH]);
+
+			Sample* out = stack->column(0, i) + firstLayer;
+			for (int j = 0; j < env->WIDTH; j++)
+			{
+				for (int l = 0; l < layers; l++)
+					out[l] = rows[l][j];
+				out += env->DEPTH;
+			}
 
-	try {
-		options
-			.positional_help("[optional args]")
-			.show_positional_help();
+			for (int l = 0; counting && l < layers; l++)
+			{
+				for (int j = 0; j < env->WIDTH; j++)
+					counts[rows[l][j]]++;
+			}
+		}
+		if (counting)
+			mergeHistogram(counts, &histogram, &merging);
+	});
 
-		options.add_options("Input/Output") //For all variables influencing the input
-			("f,folder", "Folder name containing image data", cxxopts::value<std::string>(env->imageFolderName))
-			("s,save", "Save all outputs as images", cxxopts::value<bool>(env->SAVE))
-			("t,table", "Save thickness vs concentration as table", cxxopts::value<bool>(env->TABLE))
-			("table_bins", "Number of bins for output table", cxxopts::value<int>(env->TABLE_BIN_SIZE)->default_value("500"))
-			("o,overlay", "Overlay descriptive information on outputs", cxxopts::value<bool>(env->OVERLAY))
-			("d,display", "Display all outputs to screen", cxxopts::value<bool>(env->DISPLAY))
-			("disp_percent", "% scale of original image size", cxxopts::value<int>(env->DISP_PERCENT)->default_value("30"))
-			;
+	if (env->CACHE)
+	{
+		if (env->VERBOSE)
+			std::cout << "Saving stack cache..." << std::endl;
+		saveStackCache(*stack, env);
+	}
+	if (counting)
+		selectThreshold(histogram, env);
+}
 
-		options.add_options("Biofilm") //For all variables influencing the analysis
-			("m,minimum_threshold", "Minimum intensity threshold for detection", cxxopts::value<int>(env->THRESHOLD)->default_value("50"))
-			("layer_blur", "2D image blur radius", cxxopts::value<int>(env->LAYER_BLUR)->default_value("0"))
-			("max_space", "Largest allowable vertical gap", cxxopts::value<int>(env->MAX_SPACE)->default_value("100"))
-			;
+template void loadImages<unsigned char>(ImageStack* stack, EnvironmentVariables* env);
+template void loadImages<uint16_t>(ImageStack16* stack, EnvironmentVariables* env);
 
-		options.add_options("Concentration") //For all variables influencing the output of data
-			("c,concentration", "Concentration gradient", cxxopts::value<bool>(env->A_CONCENTRATION))
-			("conc_step", "Step size for concentration lines around 50%", cxxopts::value<int>(env->CONC_STEP)->default_value("20"))
-			("conc_offset", "Offset in pixels for start of concentration analysis from mixing point", cxxopts::value<int>(env->CONC_OFFSET)->default_value("200"))
-			("conc_fidelity", "Number of iterations to calculate concentration gradient", cxxopts::value<int>(env->CONC_FIDELITY)->default_value("30"))
-			;
+//Threshold the analysed channel as it is loaded, so only one bit per voxel is ever kept
+template<typename Sample>
+void loadBitLayers(BitStack* stack, const TiffStack* tiff, EnvironmentVariables* env)
+{
+	loadLayers<Sample>(tiff, 0, env->HEIGHT, true, env, [&](const std::vector<Layer<Sample>>& batch, int firstLayer, int layers, int firstRow, int endRow) {
+		std::vector<const Sample*> rows(layers);
+		std::vector<const uint64_t*> masks(layers);
+		std::vector<Sample> buffers(size_t(layers) * env->WIDTH);
+		for (int i = firstRow; i < endRow; i++)
+		{
+			//Blurred layers arrive already thresholded
+			for (int l = 0; l < layers; l++)
+			{
+				if (batch[l].mask.empty())
+					rows[l] = batch[l].row(i, &buffers[size_t(l) * env->WIDTH]);
+				else
+					masks[l] = batch[l].maskRow(i);
+			}
 
-		options.add_options() //Other options
-			("h, help", "Print help")
-			("v,verbose", "Verbose mode", cxxopts::value<bool>(env->VERBOSE))
-			;
+			uint64_t* out = stack->column(0, i);
+			for (int j = 0; j < env->WIDTH; j++)
+			{
+				for (int l = 0; l < layers; l++)
+				{
+					const int layer = firstLayer + l;
+					if (batch[l].mask.empty() ? rows[l][j] > env->THRESHOLD : (masks[l][j / 64] >> (j % 64)) & 1)
+						out[layer / 64] |= uint64_t(1) << (layer % 64);
+				}
+				out += stack->WORDS;
+			}
+		}
+	});
+}
 
-		auto result = options.parse(argc, argv);
+template<typename Sample>
+void loadCachedBits(BitStack* stack, EnvironmentVariables* env)
+{
+	VoxelStack<Sample> voxels;
+	loadImages(&voxels, env);
 
-		//If help is selected, do not continue to run the program and simply display the help text
-		if (result.count("help")) {
-			std::cout << options.help({}) << std::endl;
-			exit(0);
+	parallelRows(env->HEIGHT, env->THREADS, [&](int firstRow, int endRow, int /*band*/) {
+		for (int i = firstRow; i < endRow; i++)
+		{
+			for (int j = 0; j < env->WIDTH; j++)
+			{
+				const Sample* column = voxels.column(j, i);
+				uint64_t* bits = stack->column(j, i);
+				for (int z = 0; z < env->DEPTH; z++)
+				{
+					if (column[z] > env->THRESHOLD)
+						bits[z / 64] |= uint64_t(1) << (z % 64);
+				}
+			}
 		}
-	}
-	catch (const cxxopts::OptionException& e) {
-		std::cout << "error parsing options: " << e.what() << std::endl;
-		exit(-1);
-	}
+	});
 }
 
-void setEnvironmentVariables(EnvironmentVariables* env)
+void loadImages(BitStack* stack, EnvironmentVariables* env)
 {
-	//Check if image folder exists
-	if (!fs::exists(env->imageFolderName))
+	initDimensions(env);
+	stack->HEIGHT = env->HEIGHT;
+	stack->WIDTH = env->WIDTH;
+	stack->DEPTH = env->DEPTH;
+	stack->WORDS = (env->DEPTH + 63) / 64;
+	stack->bits.assign(size_t(env->HEIGHT) * env->WIDTH * stack->WORDS, 0);
+
+	//The stack cache holds intensities, so threshold the cached (or newly cached) stack rather than the layers
+	if (env->CACHE)
 	{
-		throw ("Image folder path " + env->imageFolderName + " does not exist").c_str();
+		if (env->BIT_DEPTH > 8)
+			loadCachedBits<uint16_t>(stack, env);
+		else
+			loadCachedBits<unsigned char>(stack, env);
+		return;
 	}
 
-	int number_of_images = 0, number_of_non_images = 0;
+	TiffStack tiff;
+	if (env->STACK_FILE)
+		tiff.open(env->imageFileNames[0]);
+	thresholdLayers(env->STACK_FILE ? &tiff : nullptr, env->HEIGHT, env);
 
-	//Initialize vector of image names to be blank
-	env->imageFileNames = {};
+	if (env->BIT_DEPTH > 8)
+		loadBitLayers<uint16_t>(stack, env->STACK_FILE ? &tiff : nullptr, env);
+	else
+		loadBitLayers<unsigned char>(stack, env->STACK_FILE ? &tiff : nullptr, env);
+}
 
-	for (auto & p : fs::directory_iterator(env->imageFolderName))
-	{
-		//Convert Path to string
-		static std::string filename;
-		filename = p.path().u8string();
+//Fold rows [firstRow, endRow) of the layers into the per-pixel thickness in z order as they are loaded, the same way columnThickness walks a column
+//Only the confirmed count and the current gap of each pixel are kept, instead of the whole stack
+template<typename Sample>
+void streamLayers(std::vector<int>* OUTPUT, const TiffStack* tiff, int firstRow, int endRow, EnvironmentVariables* env)
+{
+	//A gap of -1 means nothing has been detected in the column yet
+	std::vector<int> gaps(size_t(endRow - firstRow) * env->WIDTH, -1);
 
-		//Check if string represents a subfolder
-		if (filename.find(".") == -1)
+	loadLayers<Sample>(tiff, firstRow, endRow, true, env, [&](const std::vector<Layer<Sample>>& batch, int /*firstLayer*/, int layers, int first, int end) {
+		std::vector<Sample> buffer(env->WIDTH);
+		for (int i = first; i < end; i++)
 		{
-			throw "Image folder must not contain subfolders";
+			int* confirmed = &(*OUTPUT)[size_t(i) * env->WIDTH];
+			int* gap = &gaps[size_t(i - firstRow) * env->WIDTH];
+			for (int l = 0; l < layers; l++)
+			{
+				//Blurred layers arrive already thresholded
+				const bool masked = !batch[l].mask.empty();
+				const Sample* row = masked ? nullptr : batch[l].row(i, buffer.data());
+				const uint64_t* mask = masked ? batch[l].maskRow(i) : nullptr;
+				for (int j = 0; j < env->WIDTH; j++)
+				{
+					if (masked ? (mask[j / 64] >> (j % 64)) & 1 : row[j] > env->THRESHOLD)
+					{
+						if (gap[j] > 0 && gap[j] <= env->MAX_SPACE)
+							confirmed[j] += gap[j];
+						confirmed[j]++;
+						gap[j] = 0;
+					}
+					else if (gap[j] >= 0)
+					{
+						gap[j]++;
+					}
+				}
+			}
 		}
+	});
+}
 
-		//Set list of supported file types
-		std::vector<std::string> supported_types;
-		supported_types = { "bmp" , "BMP" };
+//Bytes held at full size whatever the budget: the thickness of every pixel, the biofilm and display images,
+//and the packed concentration image and float thickness map when they are saved
+size_t fullSizeBytes(EnvironmentVariables* env)
+{
+	const size_t pixels = size_t(env->WIDTH) * env->HEIGHT;
+	return pixels * (sizeof(int) + 3 + 3 + (env->SAVE_CONC ? 3 : 0) + (env->SAVE_THICKNESS.empty() ? 0 : sizeof(float)));
+}
 
-		//Ensure the file is a supported filetype
-		if (std::find(supported_types.begin(), supported_types.end(), filename.substr(filename.find_last_of(".") + 1)) != supported_types.end()) {
-			//Add file to the image list
-			env->imageFileNames.emplace_back(filename);
-			number_of_images++;
-		}
-		else {
-			number_of_non_images++;
-		}
+//Rows per tile that keep the working set of a tile within what --mem_budget leaves after the full size buffers, given the bytes
+//every row of a tile needs and the bytes every row read around a tile (its blur halo) needs. Without a budget the whole image is one tile
+int tileRows(EnvironmentVariables* env, size_t bytesPerRow, size_t bytesPerHaloRow)
+{
+	if (env->MEM_BUDGET <= 0)
+		return env->HEIGHT;
+
+	const size_t total = size_t(env->MEM_BUDGET) * 1024 * 1024, fixed = fullSizeBytes(env);
+	const size_t budget = total > fixed ? total - fixed : 0, halo = bytesPerHaloRow * 2 * blurHalo(env);
+	const size_t rows = budget > halo ? (budget - halo) / std::max<size_t>(bytesPerRow, 1) : 0;
+	return int(std::max<size_t>(1, std::min<size_t>(rows, env->HEIGHT)));
+}
+
+//Warn when --mem_budget cannot be kept to: the full size buffers alone take more, or a single row of layers does not fit in what is left
+void checkMemBudget(size_t bytesPerRow, size_t bytesPerHaloRow, EnvironmentVariables* env)
+{
+	const size_t total = size_t(env->MEM_BUDGET) * 1024 * 1024, fixed = fullSizeBytes(env);
+	const size_t smallest = fixed + bytesPerRow + bytesPerHaloRow * 2 * blurHalo(env);
+	if (fixed >= total)
+		std::cout << "Warning: the outputs alone take " << (fixed + 1024 * 1024 - 1) / (1024 * 1024) << " MB, more than --mem_budget allows" << std::endl;
+	else if (smallest > total)
+		std::cout << "Warning: even one row at a time takes " << (smallest + 1024 * 1024 - 1) / (1024 * 1024) << " MB, more than --mem_budget allows" << std::endl;
+}
+
+void streamThickness(std::vector<int>* OUTPUT, EnvironmentVariables* env)
+{
+	initDimensions(env);
+	OUTPUT->assign(size_t(env->HEIGHT) * env->WIDTH, 0);
+
+	TiffStack tiff;
+	if (env->STACK_FILE)
+		tiff.open(env->imageFileNames[0]);
+
+	//A tile holds the loaded layers (rows and halo), plus the gap of each of its pixels
+	const size_t sampleBytes = env->BIT_DEPTH > 8 ? 2 : 1;
+	const size_t layerRowBytes = size_t(loadedLayers(env->STACK_FILE, env)) * env->WIDTH * sampleBytes;
+	const int rows = tileRows(env, layerRowBytes + size_t(env->WIDTH) * sizeof(int), layerRowBytes);
+	if (env->MEM_BUDGET > 0)
+		checkMemBudget(layerRowBytes + size_t(env->WIDTH) * sizeof(int), layerRowBytes, env);
+	thresholdLayers(env->STACK_FILE ? &tiff : nullptr, rows, env);
+
+	for (int firstRow = 0; firstRow < env->HEIGHT; firstRow += rows)
+	{
+		const int endRow = std::min(env->HEIGHT, firstRow + rows);
+		if (env->VERBOSE && rows < env->HEIGHT)
+			std::cout << "Measuring rows " << firstRow << " to " << endRow - 1 << "..." << std::endl;
+
+		if (env->BIT_DEPTH > 8)
+			streamLayers<uint16_t>(OUTPUT, env->STACK_FILE ? &tiff : nullptr, firstRow, endRow, env);
+		else
+			streamLayers<unsigned char>(OUTPUT, env->STACK_FILE ? &tiff : nullptr, firstRow, endRow, env);
 	}
+}
 
-	//Set the depth to be the number of images in the folder
-	env->DEPTH = number_of_images;
+template<typename Sample>
+cimg_library::CImg<unsigned char> previewLayer(const TiffStack* tiff, EnvironmentVariables* env)
+{
+	Layer<Sample> layer;
+	loadLayer(0, tiff, nullptr, 0, env->HEIGHT, false, env, &layer);
+	detachLayer(&layer, 0, env->HEIGHT, env);
+	return cimg_library::CImg<unsigned char>(layer.image.normalize(0, 255));
+}
 
-	if (number_of_images == 0)
-		throw "No supported images in directory";
+//The bottom layer as an 8-bit image, for picking the mixing point on screen
+cimg_library::CImg<unsigned char> loadPreviewLayer(EnvironmentVariables* env)
+{
+	if (!env->STACK_FILE)
+		return cimg_library::CImg<unsigned char>(env->imageFileNames[0].c_str());
+
+	TiffStack tiff;
+	tiff.open(env->imageFileNames[0]);
+	if (env->BIT_DEPTH > 8)
+		return previewLayer<uint16_t>(&tiff, env);
+	return previewLayer<unsigned char>(&tiff, env);
+}
 
-	if (number_of_images == 1)
-		throw "Multiple images required for analysis";
 
-	if (number_of_non_images == 1)
-		std::cout << "Found " << number_of_non_images << " unsupported file. This will be ignored" << std::endl;
-	else if (number_of_non_images > 1)
-		std::cout << "Found " << number_of_non_images << " unsupported files. These will be ignored" << std::endl;
+//Bit helpers for the packed stack; x must be non-zero for countTrailingZeros
+inline int countTrailingZeros(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return int(index);
+#else
+	return __builtin_ctzll(x);
+#endif
 }
 
-void loadImages(cimg_library::CImgList<unsigned char>* list, EnvironmentVariables* env)
+inline int popCount(uint64_t x)
 {
-	bool env_init = false;
-	for (std::vector<std::string>::iterator it = env->imageFileNames.begin(); it != env->imageFileNames.end(); ++it) {
+#ifdef _MSC_VER
+	return int(__popcnt64(x));
+#else
+	return __builtin_popcountll(x);
+#endif
+}
 
-		if (env->VERBOSE)
+//Number of confirmed layers in one z-column: detected voxels, plus the gaps between them of at most MAX_SPACE layers
+template<typename Sample>
+int columnThickness(const Sample* column, EnvironmentVariables* env)
+{
+	int counter = 0, confirmed = 0, last = -1;
+	for (int im = 0; im < env->DEPTH; im++)
+	{
+		if (column[im] > env->THRESHOLD)
 		{
-			std::cout << "Loading image: " << (*it) << std::endl;
+			if (counter > env->MAX_SPACE)
+			{
+				counter = 0;
+			}
+			confirmed = confirmed + counter + 1;
+			last = im;
+			counter = 0;
 		}
-		const char *charImageName = (*it).c_str();
-		cimg_library::CImg<unsigned char> src(charImageName);
-
-		//If it is the first image in the list, use this to determine environment variables
-		if (!env_init)
+		else if (last != -1)
 		{
-			env->HEIGHT = src.height();
-			env->WIDTH = src.width();
-			env->DISP_HEIGHT = env->HEIGHT*(float(env->DISP_PERCENT)*0.01f);
-			env->DISP_WIDTH = env->WIDTH*(float(env->DISP_PERCENT)*0.01f);
-			env_init = true;
+			counter++;
 		}
-		//If not, make sure the dimensions are consistent
-		else if(src.width() != env->WIDTH || src.height() != env->HEIGHT)
+	}
+	return confirmed;
+}
+
+template int columnThickness<unsigned char>(const unsigned char* column, EnvironmentVariables* env);
+template int columnThickness<uint16_t>(const uint16_t* column, EnvironmentVariables* env);
+
+//Same count on a packed column, done one run of detected layers at a time instead of one layer at a time
+int columnThickness(const uint64_t* column, EnvironmentVariables* env)
+{
+	const int words = (env->DEPTH + 63) / 64;
+	int confirmed = 0, last = -1;
+	for (int w = 0; w < words; w++)
+	{
+		uint64_t word = column[w];
+		while (word)
 		{
-			throw "Inconsistent image dimensions: please check that all images in folder are the same dimensions";
+			//Isolate the lowest run of set bits: adding its lowest bit carries through the run and clears it
+			const uint64_t rest = word & (word + (word & (0 - word)));
+			const int start = w * 64 + countTrailingZeros(word);
+			const int length = popCount(word ^ rest);
+
+			//Runs split across two words meet with a gap of zero, which is always filled
+			if (last != -1 && start - last - 1 <= env->MAX_SPACE)
+			{
+				confirmed += start - last - 1;
+			}
+			confirmed += length;
+			last = start + length - 1;
+			word = rest;
 		}
-		src.blur(env->LAYER_BLUR);
-		list->insert(src);
 	}
+	return confirmed;
 }
 
-cimg_library::CImg<unsigned char> calcBiofilm(cimg_library::CImgList<unsigned char>* list, EnvironmentVariables* env, bool isDisplay)
+template<typename Stack>
+void calcBiofilm(const Stack* stack, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage)
 {
-	cimg_library::CImg<unsigned char> output = (*list)[1];
-	int** OUTPUT;
+	//Thickness of every pixel, computed once and shared by both output images
+	std::vector<int> OUTPUT;
+	measureThickness(stack, env, &OUTPUT);
+	drawThickness(OUTPUT, env, biofilmImage, displayImage);
+}
 
-	OUTPUT = new int*[env->HEIGHT];
-	for (int i = 0; i < env->HEIGHT; i++)
-	{
-		OUTPUT[i] = new int[env->WIDTH];
-	}
+template void calcBiofilm<ImageStack>(const ImageStack* stack, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage);
+template void calcBiofilm<ImageStack16>(const ImageStack16* stack, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage);
+template void calcBiofilm<BitStack>(const BitStack* stack, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage);
+
+//Number of confirmed layers of every pixel
+template<typename Stack>
+void measureThickness(const Stack* stack, EnvironmentVariables* env, std::vector<int>* OUTPUT)
+{
+	OUTPUT->assign(size_t(env->HEIGHT) * env->WIDTH, 0);
 
-	for (int i = 0; i < env->HEIGHT; i++)
+	parallelRows(env->HEIGHT, env->THREADS, [&](int firstRow, int endRow, int /*band*/)
 	{
-		for (int j = 0; j < env->WIDTH; j++)
+		for (int i = firstRow; i < endRow; i++)
 		{
-			OUTPUT[i][j] = 0;
+			for (int j = 0; j < env->WIDTH; j++)
+			{
+				(*OUTPUT)[size_t(i) * env->WIDTH + j] = columnThickness(stack->column(j, i), env);
+			}
 		}
-	}
+	});
+}
 
-	int maxVal = 0;
+template void measureThickness<ImageStack>(const ImageStack* stack, EnvironmentVariables* env, std::vector<int>* OUTPUT);
+template void measureThickness<ImageStack16>(const ImageStack16* stack, EnvironmentVariables* env, std::vector<int>* OUTPUT);
+template void measureThickness<BitStack>(const BitStack* stack, EnvironmentVariables* env, std::vector<int>* OUTPUT);
+
+//Scale the images to the largest thickness (only counting the region downstream of the mixing point when the concentration is analysed) and draw them
+void drawThickness(const std::vector<int>& OUTPUT, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage)
+{
+	//Each band of rows keeps its own maximum, merged afterwards in band order
+	std::vector<int> bandMax(env->THREADS, 0);
 
-	for (int i = 0; i < env->HEIGHT; i++)
+	parallelRows(env->HEIGHT, env->THREADS, [&](int firstRow, int endRow, int band)
 	{
-		for (int j = 0; j < env->WIDTH; j++)
+		int maxVal = 0;
+
+		for (int i = firstRow; i < endRow; i++)
 		{
-			int counter = 0, confirmed = 0, last = -1;
-			for (int im = 0; im < env->DEPTH; im++)
+			for (int j = 0; j < env->WIDTH; j++)
 			{
-				if ((*list)[im](j, i, 0, 1) > env->THRESHOLD)
+				const int thickness = OUTPUT[size_t(i) * env->WIDTH + j];
+
+				if (env->A_CONCENTRATION)
 				{
-					if (counter > env->MAX_SPACE)
+					if (env->FACING && j < env->MIX_X)
 					{
-						counter = 0;
+						if (thickness > maxVal)
+						{
+							maxVal = thickness;
+						}
 					}
-					confirmed = confirmed + counter + 1;
-					last = im;
-					counter = 0;
-				}
-				else if (last != -1)
-				{
-					counter++;
-				}
-			}
-			if (confirmed > 0)
-			{
-				for (int im = 0; im < confirmed; im++)
-				{
-					OUTPUT[i][j] += 255 / env->DEPTH;
-				}
-			}
-			if (env->A_CONCENTRATION)
-			{
-				if (env->FACING && j < env->MIX_X)
-				{
-					if (OUTPUT[i][j] > maxVal)
+					if (!env->FACING && j > env->MIX_X)
 					{
-						maxVal = OUTPUT[i][j];
+						if (thickness > maxVal)
+						{
+							maxVal = thickness;
+						}
 					}
 				}
-				if (!env->FACING && j > env->MIX_X)
+				else
 				{
-					if (OUTPUT[i][j] > maxVal)
+					if (thickness > maxVal)
 					{
-						maxVal = OUTPUT[i][j];
+						maxVal = thickness;
 					}
 				}
 			}
-			else
-			{
-				if (OUTPUT[i][j] > maxVal)
-				{
-					maxVal = OUTPUT[i][j];
-				}
-			}
 		}
-	}
 
-	env->MAX_THICKNESS = maxVal * float(env->DEPTH) / 255.f;
+		bandMax[band] = maxVal;
+	});
 
-	for (int i = 0; i < env->HEIGHT; i++)
+	int maxVal = 0;
+	for (int band = 0; band < env->THREADS; band++)
 	{
-		for (int j = 0; j < env->WIDTH; j++)
-		{
-				static int M;
-				M = 255 * float(OUTPUT[i][j]) / float(maxVal);
-				if (M > 255)
-					M = 255;
-
-				if (isDisplay)
-				{
-					colour Col = getHeatmapColour(M);
-
-					output(j, i, 0) = Col.R;
-					output(j, i, 1) = Col.G;
-					output(j, i, 2) = Col.B;
-				}
-				else
-				{
-					output(j, i, 0) = M;
-					output(j, i, 1) = M;
-					output(j, i, 2) = M;
-				}
-		}
+		maxVal = std::max(maxVal, bandMax[band]);
 	}
 
-	return output;
+	env->MAX_THICKNESS = maxVal * env->LAYER_THICKNESS;
+
+	drawBiofilm(OUTPUT, maxVal, env, biofilmImage, displayImage);
 }
 
-cimg_library::CImg<unsigned char> calcConcentrationGradient(cimg_library::CImgList<unsigned char>* list, EnvironmentVariables* env)
+//Fill the grayscale data image and the heatmap display image from the thickness buffer in the same pass
+void drawBiofilm(const std::vector<int>& thickness, int maxVal, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage)
 {
-	cimg_library::CImg<unsigned char> output = (*list)[1];
-	int** OUTPUT;
+	//Thickness only takes DEPTH + 1 distinct values, so map each one to its grey level and heatmap colour up front
+	const int levels = env->DEPTH + 1;
+	std::vector<unsigned char> grey(levels), red(levels), green(levels), blue(levels);
+	for (int val = 0; val < levels; val++)
+	{
+		int M = 0;
+		if (maxVal > 0)
+			M = 255 * float(val) / float(maxVal);
+		if (M > 255)
+			M = 255;
+
+		grey[val] = M;
+		red[val] = HEATMAP.R[M];
+		green[val] = HEATMAP.G[M];
+		blue[val] = HEATMAP.B[M];
+	}
 
-	float C_max = 256.f*256.f*256.f, D = env->DIFFUSIVITY, L = env->CHAN_WIDTH, h = L/2, flow_rate = env->FLOW_RATE*1000000000.f/(60.f*60.f*env->CROSS_AREA);
+	biofilmImage->assign(env->WIDTH, env->HEIGHT, 1, 3);
+	displayImage->assign(env->WIDTH, env->HEIGHT, 1, 3);
 
-	int C = 0, k_max = env->CONC_FIDELITY;
+	//CImg stores each channel as its own plane, so every output channel is one table lookup per pixel over a contiguous run
+	const size_t plane = size_t(env->WIDTH) * env->HEIGHT;
+	const int* in = thickness.data();
+	unsigned char* data = biofilmImage->data();
+	unsigned char* display = displayImage->data();
 
-	OUTPUT = new int*[env->HEIGHT];
-	for (int i = 0; i < env->HEIGHT; i++)
+	parallelRows(env->HEIGHT, env->THREADS, [&](int firstRow, int endRow, int /*band*/)
 	{
-		OUTPUT[i] = new int[env->WIDTH];
-	}
+		const size_t first = size_t(firstRow) * env->WIDTH, end = size_t(endRow) * env->WIDTH;
+		for (size_t p = first; p < end; p++)
+			data[p] = grey[in[p]];
+		for (size_t p = first; p < end; p++)
+			display[p] = red[in[p]];
+		for (size_t p = first; p < end; p++)
+			display[plane + p] = green[in[p]];
+		for (size_t p = first; p < end; p++)
+			display[2 * plane + p] = blue[in[p]];
+
+		std::copy(data + first, data + end, data + plane + first);
+		std::copy(data + first, data + end, data + 2 * plane + first);
+	});
+}
 
-	for (int i = 0; i < env->HEIGHT; i++)
+//Cache-blocked single precision matrix product: out[i][j] += a[i][k] * b[k][j] for rows [firstRow, endRow) and columns [firstCol, endCol)
+//a is rows x depth and b is depth x cols, both row-major; out is rows x cols. The inner loop runs along a row of b
+//and four rows of out at once, which compilers turn into vector multiply-adds
+void multiplyBlocked(const float* a, const float* b, float* out, int firstRow, int endRow, int firstCol, int endCol, int cols, int depth)
+{
+	const int ROW_BLOCK = 4, COL_BLOCK = 256, DEPTH_BLOCK = 64; //A 64 x 256 panel of b stays in L1/L2 while it is reused
+
+	for (int j0 = firstCol; j0 < endCol; j0 += COL_BLOCK)
 	{
-		if (env->FACING)
+		const int j1 = std::min(j0 + COL_BLOCK, endCol);
+		for (int k0 = 0; k0 < depth; k0 += DEPTH_BLOCK)
 		{
-			for (int j = env->WIDTH-1; j >= 0; j--)
+			const int k1 = std::min(k0 + DEPTH_BLOCK, depth);
+			int i = firstRow;
+			for (; i + ROW_BLOCK <= endRow; i += ROW_BLOCK)
 			{
-				if (j > env->MIX_X)
+				float* __restrict out0 = out + size_t(i) * cols;
+				float* __restrict out1 = out0 + cols;
+				float* __restrict out2 = out1 + cols;
+				float* __restrict out3 = out2 + cols;
+				for (int k = k0; k < k1; k++)
 				{
-					if (i > env->MIX_Y)
-					{
-						C = 0;
-					}
-					else
+					const float a0 = a[size_t(i) * depth + k], a1 = a[size_t(i + 1) * depth + k];
+					const float a2 = a[size_t(i + 2) * depth + k], a3 = a[size_t(i + 3) * depth + k];
+					const float* __restrict bk = b + size_t(k) * cols;
+					for (int j = j0; j < j1; j++)
 					{
-						C = C_max;
+						out0[j] += a0 * bk[j];
+						out1[j] += a1 * bk[j];
+						out2[j] += a2 * bk[j];
+						out3[j] += a3 * bk[j];
 					}
 				}
-				else
+			}
+			//Leftover rows when the band is not a multiple of ROW_BLOCK
+			for (; i < endRow; i++)
+			{
+				float* __restrict out0 = out + size_t(i) * cols;
+				for (int k = k0; k < k1; k++)
 				{
-					float sum_part = 0.f;
-					for (int k = 1; k < k_max; k++)
-					{
-						sum_part += (1 / float(k))*
-							std::sinf(float(k)*M_PI*h / L)*
-							std::exp(-D * float(k)*float(k)*M_PI*M_PI*float(env->MIX_X + 1 - j)* env->PIXEL_WIDTH / (L* L*flow_rate))*
-							std::cosf(float(k)*M_PI*(float(i - env->MIX_Y)* env->PIXEL_WIDTH + h) / L);
-					}
-					C = C_max * (sum_part * 2.f / M_PI + h / L);
-					if (C < 0)
-					{
-						C = 0;
-					}
-					if (C > C_max)
+					const float a0 = a[size_t(i) * depth + k];
+					const float* __restrict bk = b + size_t(k) * cols;
+					for (int j = j0; j < j1; j++)
 					{
-						C = C_max;
+						out0[j] += a0 * bk[j];
 					}
 				}
-				OUTPUT[i][j] = C;
 			}
 		}
-		else
+	}
+}
+
+cimg_library::CImg<float> calcConcentrationGradient(EnvironmentVariables* env)
+{
+	return calcConcentrationRows(env, 0, env->HEIGHT);
+}
+
+//Concentration of rows [firstRow, endRow), so large images can be done a band of rows at a time
+cimg_library::CImg<float> calcConcentrationRows(EnvironmentVariables* env, int firstRow, int endRow)
+{
+	const int rows = endRow - firstRow;
+	cimg_library::CImg<float> output(env->WIDTH, rows, 1, 1);
+
+	const int terms = std::max(0, env->CONC_FIDELITY - 1); //Series runs over k = 1 .. CONC_FIDELITY-1
+
+	//Columns downstream of the mixing point, where the series applies
+	const int firstCol = env->FACING ? 0 : std::max(0, std::min(env->MIX_X, env->WIDTH));
+	const int endCol = env->FACING ? std::max(0, std::min(env->MIX_X + 1, env->WIDTH)) : env->WIDTH;
+
+	//Each term of the series is (1/k)*sin(k*pi*h/L), times an exponential that only depends on the column,
+	//times a cosine that only depends on the row. With the factors tabulated, the series over the whole image
+	//is the product of a HEIGHT x K row matrix and a K x WIDTH column matrix
+	std::vector<float> columnTerms(size_t(terms) * env->WIDTH, 0.f);
+	std::vector<float> rowTerms(size_t(rows) * terms, 0.f);
+
+	for (int k = 1; k <= terms; k++)
+	{
+		for (int j = firstCol; j < endCol; j++)
+		{
+			columnTerms[size_t(k - 1) * env->WIDTH + j] = concColumnTerm(env, k, j);
+		}
+	}
+
+	for (int i = 0; i < rows; i++)
+	{
+		for (int k = 1; k <= terms; k++)
+		{
+			rowTerms[size_t(i) * terms + k - 1] = concRowTerm(env, k, firstRow + i);
+		}
+	}
+
+	//Series sum of every pixel
+	std::vector<float> sums(size_t(rows) * env->WIDTH, 0.f);
+
+	parallelRows(rows, env->THREADS, [&](int first, int end, int /*band*/)
+	{
+		multiplyBlocked(rowTerms.data(), columnTerms.data(), sums.data(), first, end, firstCol, endCol, env->WIDTH, terms);
+
+		for (int i = first; i < end; i++)
 		{
 			for (int j = 0; j < env->WIDTH; j++)
 			{
-				if (j < env->MIX_X)
+				float C = 0.f;
+
+				//Upstream of the mixing point the two streams have not met yet
+				if (j < firstCol || j >= endCol)
 				{
-					if (i > env->MIX_Y)
+					if (firstRow + i > env->MIX_Y)
 					{
-						C = 0;
+						C = 0.f;
 					}
 					else
 					{
-						C = C_max;
+						C = 100.f;
 					}
 				}
 				else
 				{
-					float sum_part = 0.f;
-					for (int k = 1; k < k_max; k++)
-					{
-						sum_part += (1 / float(k))*
-							std::sinf(float(k)*M_PI*h / L)*
-							std::exp(-D * float(k)*float(k)*M_PI*M_PI*float(j - env->MIX_X + 1)* env->PIXEL_WIDTH / (L* L*flow_rate))*
-							std::cosf(float(k)*M_PI*(float(i - env->MIX_Y)* env->PIXEL_WIDTH + h) / L);
-					}
-					C = C_max * (sum_part * 2.f / M_PI + h / L);
-					if (C < 0)
-					{
-						C = 0;
-					}
-					if (C > C_max)
-					{
-						C = C_max;
-					}
+					C = concFromSeries(env, sums[size_t(i) * env->WIDTH + j]);
 				}
-				OUTPUT[i][j] = C;
+
+				output(j, i) = C;
 			}
 		}
+	});
+
+	return output;
+}
+
+//Factor of term k of the concentration series that only depends on the column: (1/k)*sin(k*pi*h/L)*exp(-D*(k*pi/L)^2*distance/flow_rate)
+float concColumnTerm(EnvironmentVariables* env, int k, int x)
+{
+	float D = env->DIFFUSIVITY, L = env->CHAN_WIDTH, h = L/2, flow_rate = env->FLOW_RATE*1000000000.f/(60.f*60.f*env->CROSS_AREA);
+
+	//Distance downstream of the mixing point, in pixels
+	float distance = env->FACING ? float(env->MIX_X + 1 - x) : float(x - env->MIX_X + 1);
+
+	return float((1 / double(k))*
+		std::sin(double(k)*M_PI*h / L)*
+		std::exp(-D * double(k)*double(k)*M_PI*M_PI*distance* env->PIXEL_WIDTH / (L* L*flow_rate)));
+}
+
+//Factor of term k of the concentration series that only depends on the row
+float concRowTerm(EnvironmentVariables* env, int k, int y)
+{
+	float L = env->CHAN_WIDTH, h = L/2;
+	return float(std::cos(double(k)*M_PI*(float(y - env->MIX_Y)* env->PIXEL_WIDTH + h) / L));
+}
+
+//Concentration of the upper stream in %, from the sum of the series terms
+float concFromSeries(EnvironmentVariables* env, float sum)
+{
+	float C_max = 100.f, L = env->CHAN_WIDTH, h = L/2;
+
+	float C = C_max * (sum * 2.f / M_PI + h / L);
+	if (C < 0)
+	{
+		C = 0;
+	}
+	if (C > C_max)
+	{
+		C = C_max;
+	}
+	return C;
+}
+
+//Concentration of the upper stream in % at a single pixel, evaluated from the series without the full image
+float getConcAt(EnvironmentVariables* env, int x, int y)
+{
+	//Upstream of the mixing point the two streams have not met yet
+	if ((env->FACING && x > env->MIX_X) || (!env->FACING && x < env->MIX_X))
+	{
+		return y > env->MIX_Y ? 0.f : 100.f;
+	}
+
+	float sum = 0.f;
+	for (int k = 1; k < env->CONC_FIDELITY; k++)
+	{
+		sum += concColumnTerm(env, k, x) * concRowTerm(env, k, y);
+	}
+	return concFromSeries(env, sum);
+}
+
+//Row where the concentration in a column first rises above level, or -1 if it never does. The profile is monotonic
+//in y, so this bisects on the series itself; columnTerms holds the column factors of that column for k = 1 .. K
+int findIsoline(EnvironmentVariables* env, const std::vector<float>& columnTerms, float level, bool lowestOnTop)
+{
+	auto above = [&](int y)
+	{
+		float sum = 0.f;
+		for (int k = 1; k <= int(columnTerms.size()); k++)
+		{
+			sum += columnTerms[k - 1] * concRowTerm(env, k, y);
+		}
+		return concFromSeries(env, sum) > level;
+	};
+
+	//Conc lowest on top: find the first row from the top that is above level
+	//Conc lowest on bottom: find the first row from the bottom that is above level
+	int outside = lowestOnTop ? 0 : env->HEIGHT - 1, inside = lowestOnTop ? env->HEIGHT - 1 : 0;
+	if (!above(inside))
+	{
+		return -1;
 	}
+	if (above(outside))
+	{
+		return outside;
+	}
+	while (abs(inside - outside) > 1)
+	{
+		int middle = (inside + outside) / 2;
+		if (above(middle))
+			inside = middle;
+		else
+			outside = middle;
+	}
+	return inside;
+}
+
+//Pack the concentration into the R, G and B bytes of an image as base-256 digits, for exporting to other tools
+cimg_library::CImg<unsigned char> packConcentration(const cimg_library::CImg<float>& concImage)
+{
+	cimg_library::CImg<unsigned char> output(concImage.width(), concImage.height(), 1, 3);
+	const float C_max = 256.f*256.f*256.f - 1.f;
 
-	for (int i = 0; i < env->HEIGHT; i++)
+	for (int i = 0; i < concImage.height(); i++)
 	{
-		for (int j = 0; j < env->WIDTH; j++)
+		for (int j = 0; j < concImage.width(); j++)
 		{
-			output(j, i, 0) = OUTPUT[i][j]/(256*256);
-			output(j, i, 1) = (OUTPUT[i][j]/256)%256;
-			output(j, i, 2) = OUTPUT[i][j]%256;
+			int C = int(concImage(j, i) / 100.f * C_max);
+			output(j, i, 0) = C / (256 * 256);
+			output(j, i, 1) = (C / 256) % 256;
+			output(j, i, 2) = C % 256;
 		}
 	}
 
 	return output;
 }
 
-void drawOverlay(cimg_library::CImg<unsigned char> *concImage, cimg_library::CImg<unsigned char> *drawImage, EnvironmentVariables* env)
+void drawOverlay(cimg_library::CImg<unsigned char> *drawImage, EnvironmentVariables* env)
 {
 	int draw_size = 8, textSize = 45;
 	unsigned char white[] = { 255,255,255 };
@@ -573,127 +2521,54 @@ void drawOverlay(cimg_library::CImg<unsigned char> *concImage, cimg_library::CIm
 		step += env->CONC_STEP;
 		minstep = step;
 
-		if (env->FACING)
+		//Lines start at the offset line, which is also where they are labelled
+		const int firstColumn = env->FACING ? env->MIX_X - env->CONC_OFFSET : env->MIX_X + env->CONC_OFFSET;
+		const int labelX = env->FACING ? firstColumn + 60 : firstColumn - 60;
+
+		//Conc lowest on top, or lowest on bottom
+		const bool lowestOnTop = getConcAt(env, 0, 0) < getConcAt(env, 0, env->HEIGHT - 1);
+
+		std::vector<float> columnTerms(std::max(0, env->CONC_FIDELITY - 1));
+
+		auto traceColumn = [&](int i)
 		{
-			for (int i = env->MIX_X - env->CONC_OFFSET; i >= 0; i--)
+			for (int k = 1; k <= int(columnTerms.size()); k++)
 			{
-				while (step < 100.f)
+				columnTerms[k - 1] = concColumnTerm(env, k, i);
+			}
+
+			for (step = minstep; step < 100.f; step += float(env->CONC_STEP))
+			{
+				int j = findIsoline(env, columnTerms, step, lowestOnTop);
+				if (j < 0)
 				{
-					//Conc lowest on top
-					if (getConcValue(concImage, 0, 0) < getConcValue(concImage, 0, env->HEIGHT - 1))
-					{
-						for (int j = 0; j < env->HEIGHT; j++)
-						{
-							if (getConcValue(concImage, i, j) > step)
-							{
-								if (i == env->MIX_X - env->CONC_OFFSET)
-								{
-									drawImage->draw_text(env->MIX_X - env->CONC_OFFSET + 60, j - textSize / 2,
-										std::to_string(int(step)).c_str(),
-										white,
-										black,
-										1.f,
-										textSize);
-								}
-								step = step + float(env->CONC_STEP);
-								drawAt(drawImage, i, j, 200, 200, 200, draw_size, env);
-							}
-							if (j == env->HEIGHT-1)
-							{
-								step = 1000;
-							}
-						}
-					}
-					//Conc lowest on bottom
-					else
-					{
-						for (int j = env->HEIGHT - 1; j >= 0; j--)
-						{
-							if (getConcValue(concImage, i, j) > step)
-							{
-								if (i == env->MIX_X - env->CONC_OFFSET)
-								{
-									drawImage->draw_text(
-										env->MIX_X - env->CONC_OFFSET + 60,
-										j - textSize / 2,
-										std::to_string(int(step)).c_str(),
-										white,
-										black,
-										1.f,
-										textSize);
-								}
-								step = step + float(env->CONC_STEP);
-								drawAt(drawImage, i, j, 200, 200, 200, draw_size, env);
-							}
-							if (j == 0)
-							{
-								step = 1000;
-							}
-						}
-					}
+					break;
 				}
-				step = minstep;
+				if (i == firstColumn)
+				{
+					drawImage->draw_text(labelX, j - textSize / 2,
+						std::to_string(int(step)).c_str(),
+						white,
+						black,
+						1.f,
+						textSize);
+				}
+				drawAt(drawImage, i, j, 200, 200, 200, draw_size, env);
+			}
+		};
+
+		if (env->FACING)
+		{
+			for (int i = firstColumn; i >= 0; i--)
+			{
+				traceColumn(i);
 			}
 		}
 		else
 		{
-			for (int i = env->MIX_X + env->CONC_OFFSET; i < env->WIDTH; i++)
+			for (int i = firstColumn; i < env->WIDTH; i++)
 			{
-				while (step < 100.f)
-				{
-					//Conc lowest on top
-					if (getConcValue(concImage, 0, 0) < getConcValue(concImage, 0, env->HEIGHT - 1))
-					{
-						for (int j = 0; j < env->HEIGHT; j++)
-						{
-							if (getConcValue(concImage, i, j) > step)
-							{
-								if (i == env->MIX_X + env->CONC_OFFSET)
-								{
-									drawImage->draw_text(env->MIX_X + env->CONC_OFFSET - 60, j - textSize / 2,
-										std::to_string(int(step)).c_str(),
-										white,
-										black,
-										1.f,
-										textSize);
-								}
-								step = step + float(env->CONC_STEP);
-								drawAt(drawImage, i, j, 200, 200, 200, draw_size, env);
-							}
-							if (j == env->HEIGHT-1)
-							{
-								step = 1000;
-							}
-						}
-					}
-					//Conc lowest on bottom
-					else
-					{
-						for (int j = env->HEIGHT - 1; j >= 0; j--)
-						{
-							
-							if (getConcValue(concImage, i, j) > step)
-							{
-								if (i == env->MIX_X + env->CONC_OFFSET)
-								{
-									drawImage->draw_text(env->MIX_X + env->CONC_OFFSET - 60, j - textSize / 2,
-										std::to_string(int(step)).c_str(),
-										white,
-										black,
-										1.f,
-										textSize);
-								}
-								step = step + float(env->CONC_STEP);
-								drawAt(drawImage, i, j, 200, 200, 200, draw_size, env);
-							}
-							if (j == 0)
-							{
-								step = 1000;
-							}
-						}
-					}
-				}
-				step = minstep;
+				traceColumn(i);
 			}
 		}
 	}
@@ -725,8 +2600,11 @@ void drawOverlay(cimg_library::CImg<unsigned char> *concImage, cimg_library::CIm
 		std::string ms = "Biofilm height (µm)";
 		drawImage->draw_text(LstartX, LstartY - 60, ms.c_str(), white, black, 1, textSize);
 		drawImage->draw_text(LstartX, LstartY + 20 ,"0", white, black, 1, textSize*0.6f);
-		drawImage->draw_text((LendX + LstartX)/2 - 10, LstartY + 20, std::to_string(env->MAX_THICKNESS/2).c_str(), white, black, 1, textSize*0.6f);
-		drawImage->draw_text(LendX - 20, LstartY + 20, std::to_string(env->MAX_THICKNESS).c_str(), white, black, 1, textSize*0.6f);
+		std::ostringstream half, full;
+		half << env->MAX_THICKNESS / 2;
+		full << env->MAX_THICKNESS;
+		drawImage->draw_text((LendX + LstartX)/2 - 10, LstartY + 20, half.str().c_str(), white, black, 1, textSize*0.6f);
+		drawImage->draw_text(LendX - 20, LstartY + 20, full.str().c_str(), white, black, 1, textSize*0.6f);
 		drawImage->draw_text(LstartX, LendY - 60, "50 µm", white, black, 1, textSize);
 
 	for (int i = env->MIX_Y - env->HEIGHT/4; i < env->MIX_Y + env->HEIGHT / 4; i++)
@@ -738,9 +2616,9 @@ void drawOverlay(cimg_library::CImg<unsigned char> *concImage, cimg_library::CIm
 	}
 }
 
-float getConcValue(cimg_library::CImg<unsigned char> *image, int x, int y)
+float getConcValue(cimg_library::CImg<float> *image, int x, int y)
 {
-	return 100.f*float(image->operator()(x, y, 0) * 256 * 256 + 256 * image->operator()(x, y, 1) + image->operator()(x, y, 2))/float(256*256*256);
+	return image->operator()(x, y);
 }
 
 void drawAt(cimg_library::CImg<unsigned char> *image, int x, int y, int R, int G, int B, int size, EnvironmentVariables* env)
@@ -759,122 +2637,405 @@ void drawAt(cimg_library::CImg<unsigned char> *image, int x, int y, int R, int G
 	}
 }
 
-void calcBinnedThickness(cimg_library::CImg<unsigned char> *concImage, cimg_library::CImg<unsigned char> *biofilmImage, EnvironmentVariables* env)
+void calcBinnedThickness(cimg_library::CImg<float> *concImage, cimg_library::CImg<unsigned char> *biofilmImage, OutputWriter* writer, EnvironmentVariables* env)
+{
+	std::vector<uint64_t> counts;
+	binThickness(concImage, 0, biofilmImage, &counts, env);
+	writeBinnedThickness(counts, writer, env);
+}
+
+//Count the pixels of each concentration bin and thickness level downstream of the concentration offset, for the rows the concentration image covers
+//(starting at firstRow). Counting pixels instead of summing thicknesses lets bands of rows be binned separately and merged exactly
+void binThickness(cimg_library::CImg<float> *concRows, int firstRow, cimg_library::CImg<unsigned char> *biofilmImage, std::vector<uint64_t>* counts, EnvironmentVariables* env)
 {
 	float binSize = 100.f/float(env->TABLE_BIN_SIZE);
-	float* AV_THICKNESS;
-	float* TOT_THICK;
-	float* NUM_THICK;
+	const int lastBin = int(100.f / binSize) - 1; //A concentration of exactly 100% goes in the top bin
+	counts->resize(size_t(lastBin + 1) * 256, 0);
 
-	AV_THICKNESS = new float[(100.f / binSize)];
-	TOT_THICK = new float[(100.f / binSize)];
-	NUM_THICK = new float[(100.f / binSize)];
+	//Columns from the concentration offset onwards, downstream of the mixing point
+	const int firstCol = env->FACING ? 0 : std::max(0, env->MIX_X + env->CONC_OFFSET);
+	const int endCol = env->FACING ? std::min(env->WIDTH, env->MIX_X - env->CONC_OFFSET + 1) : env->WIDTH;
 
-	for (int j = 0; j < int(100.f / binSize); j++)
+	for (int j = 0; j < concRows->height(); j++)
 	{
-		AV_THICKNESS[j] = 0;
-		TOT_THICK[j] = 0;
-		NUM_THICK[j] = 0;
+		for (int i = firstCol; i < endCol; i++)
+		{
+			int bin = std::min(int(getConcValue(concRows, i, j) / binSize), lastBin);
+			(*counts)[size_t(bin) * 256 + biofilmImage->operator()(i, firstRow + j, 0)]++;
+		}
 	}
+}
 
-	if (env->FACING)
+void writeBinnedThickness(const std::vector<uint64_t>& counts, OutputWriter* writer, EnvironmentVariables* env)
+{
+	float binSize = 100.f/float(env->TABLE_BIN_SIZE);
+	std::vector<float> AV_THICKNESS(counts.size() / 256, 0.f);
+
+	for (size_t j = 0; j < AV_THICKNESS.size(); j++)
 	{
-		for (int i = 0; i <= env->MIX_X - env->CONC_OFFSET; i++)
+		double total = 0., number = 0.;
+		for (int level = 0; level < 256; level++)
 		{
-			for (int j = 0; j < env->HEIGHT; j++)
-			{
-				TOT_THICK[int(getConcValue(concImage, i, j) / binSize)] += float(biofilmImage->operator()(i, j, 0)) / 255.f*env->MAX_THICKNESS;
-				NUM_THICK[int(getConcValue(concImage, i, j) / binSize)] += 1;
-			}
+			total += double(counts[j * 256 + level]) * level;
+			number += double(counts[j * 256 + level]);
+		}
+
+		if (number > 0)
+		{
+			AV_THICKNESS[j] = float(total / number / 255. * env->MAX_THICKNESS);
+		}
+		else
+		{
+			AV_THICKNESS[j] = 0.f;
 		}
+	}
+
+	std::string table = "% concentration upper stream, thickness (micrometers)\n";
+
+	for (int j = 0; j < int(100.f / binSize); j++)
+	{
+		table += std::to_string(float(j*binSize)) + "," + std::to_string(AV_THICKNESS[j]) + "\n";
+	}
+
+	writer->saveText(std::move(table), env->imageFolderName + "_exma_analysis/thickness-vs-concentration.csv");
+}
+
+//Compute the concentration a band of rows at a time (sized by --mem_budget), binning the thickness against it when biofilmImage is given
+//and packing it into packedImage when that is given, so the full concentration image is never held
+void calcConcentrationTiles(cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* packedImage, OutputWriter* writer, EnvironmentVariables* env)
+{
+	std::vector<uint64_t> counts;
+	if (packedImage)
+		packedImage->assign(env->WIDTH, env->HEIGHT, 1, 3);
+
+	//Each row needs its concentration and series sums, and its share of the row factors
+	const int rows = tileRows(env, size_t(env->WIDTH) * 2 * sizeof(float) + size_t(std::max(0, env->CONC_FIDELITY - 1)) * sizeof(float), 0);
+	for (int firstRow = 0; firstRow < env->HEIGHT; firstRow += rows)
+	{
+		const int endRow = std::min(env->HEIGHT, firstRow + rows);
+		cimg_library::CImg<float> concRows = calcConcentrationRows(env, firstRow, endRow);
+
+		if (biofilmImage)
+			binThickness(&concRows, firstRow, biofilmImage, &counts, env);
+		if (packedImage)
+			packedImage->draw_image(0, firstRow, packConcentration(concRows));
+	}
+
+	if (biofilmImage)
+		writeBinnedThickness(counts, writer, env);
+}
+
+//Append a sample in little-endian byte order, as the TIFF and NumPy outputs store them
+void appendLittleEndian(std::string* out, unsigned char value)
+{
+	*out += char(value);
+}
+
+void appendLittleEndian(std::string* out, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const char bytes[4] = { char(bits), char(bits >> 8), char(bits >> 16), char(bits >> 24) };
+	out->append(bytes, 4);
+}
+
+//Append a big-endian 32-bit value, as PNG stores them
+void appendBigEndian(std::string* out, uint32_t value)
+{
+	const char bytes[4] = { char(value >> 24), char(value >> 16), char(value >> 8), char(value) };
+	out->append(bytes, 4);
+}
+
+#ifdef EXMA_ZLIB
+void appendPngChunk(std::string* out, const char* type, const std::string& data)
+{
+	appendBigEndian(out, uint32_t(data.size()));
+	const size_t start = out->size();
+	out->append(type, 4);
+	out->append(data);
+	appendBigEndian(out, uint32_t(crc32(0, (const Bytef*)out->data() + start, uInt(out->size() - start))));
+}
 
-		for (int j = 0; j < int(100.f / binSize); j++)
+//Encode an 8-bit grey or RGB image as a PNG. Bands of rows are filtered and deflated on separate threads and joined into one zlib stream,
+//each band ending on a byte boundary (a sync flush) so the next can follow it
+std::string encodePng(const cimg_library::CImg<unsigned char>& image, int threads)
+{
+	const int width = image.width(), height = image.height(), channels = image.spectrum() >= 3 ? 3 : 1;
+	const size_t rowBytes = size_t(width) * channels;
+
+	//Bands of at least 64 rows, so the bands compress nearly as well as the whole image would
+	const int bands = std::max(1, std::min(threads, height / 64));
+	std::vector<std::string> deflated(bands);
+	std::vector<uLong> checksums(bands), lengths(bands);
+	std::vector<const char*> errors(bands, nullptr);
+
+	parallelRows(height, bands, [&](int first, int end, int band) {
+		//Every row uses the Up filter (the difference to the row above), which suits the smooth thickness maps
+		std::string filtered((rowBytes + 1) * (end - first), '\0');
+		std::vector<unsigned char> above(rowBytes, 0), row(rowBytes);
+		for (int y = first; y < end; y++)
 		{
-			if (NUM_THICK[j] > 0)
+			for (int x = 0; x < width; x++)
 			{
-				AV_THICKNESS[j] = TOT_THICK[j] / NUM_THICK[j];
+				for (int c = 0; c < channels; c++)
+					row[size_t(x) * channels + c] = image(x, y, 0, c);
 			}
-			else
+			if (y == first && y > 0)
 			{
-				AV_THICKNESS[j] = 0.f;
+				for (int x = 0; x < width; x++)
+				{
+					for (int c = 0; c < channels; c++)
+						above[size_t(x) * channels + c] = image(x, y - 1, 0, c);
+				}
 			}
+
+			char* out = &filtered[(rowBytes + 1) * (y - first)];
+			out[0] = 2;
+			for (size_t i = 0; i < rowBytes; i++)
+				out[i + 1] = char(row[i] - above[i]);
+			above.swap(row);
+		}
+
+		z_stream stream = {};
+		//Run-length matching only: about ten times faster than the default level, for files about a fifth larger
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_RLE) != Z_OK)
+		{
+			errors[band] = "Could not compress an output image";
+			return;
 		}
+		deflated[band].resize(deflateBound(&stream, uLong(filtered.size())) + 16);
+		stream.next_in = (Bytef*)filtered.data();
+		stream.avail_in = uInt(filtered.size());
+		stream.next_out = (Bytef*)&deflated[band][0];
+		stream.avail_out = uInt(deflated[band].size());
+		if (deflate(&stream, band == bands - 1 ? Z_FINISH : Z_SYNC_FLUSH) == Z_STREAM_ERROR || stream.avail_in != 0)
+			errors[band] = "Could not compress an output image";
+		deflated[band].resize(stream.total_out);
+		deflateEnd(&stream);
+
+		checksums[band] = adler32(1, (const Bytef*)filtered.data(), uInt(filtered.size()));
+		lengths[band] = uLong(filtered.size());
+	});
+
+	for (const char* msg : errors)
+	{
+		if (msg)
+			throw msg;
+	}
+
+	//zlib header (deflate, 32K window, fastest level), the bands, then the checksum of all the filtered rows
+	std::string data = "\x78\x01";
+	uLong checksum = checksums[0];
+	for (int band = 0; band < bands; band++)
+	{
+		data += deflated[band];
+		if (band > 0)
+			checksum = adler32_combine(checksum, checksums[band], z_off_t(lengths[band]));
 	}
+	appendBigEndian(&data, uint32_t(checksum));
+
+	std::string header;
+	appendBigEndian(&header, uint32_t(width));
+	appendBigEndian(&header, uint32_t(height));
+	header += char(8); //Bits per sample
+	header += char(channels == 3 ? 2 : 0); //Colour type: RGB or grey
+	header.append(3, '\0'); //Deflate, adaptive filtering, no interlacing
+
+	std::string png = "\x89PNG\r\n\x1a\n";
+	appendPngChunk(&png, "IHDR", header);
+	appendPngChunk(&png, "IDAT", data);
+	appendPngChunk(&png, "IEND", std::string());
+	return png;
+}
+#else
+std::string encodePng(const cimg_library::CImg<unsigned char>& /*image*/, int /*threads*/)
+{
+	throw "This build of exma has no zlib to write PNG files: please save as bmp or tiff";
+}
+#endif
+
+//Encode an 8-bit or floating point, grey or RGB image as an uncompressed little-endian TIFF, with the pixels in one strip
+template<typename Sample>
+std::string encodeTiff(const cimg_library::CImg<Sample>& image)
+{
+	const int width = image.width(), height = image.height(), channels = image.spectrum() >= 3 ? 3 : 1;
+	const uint32_t pixelBytes = uint32_t(width) * height * channels * sizeof(Sample);
+
+	std::string tiff;
+	auto append = [&](uint32_t value, int bytes) {
+		for (int b = 0; b < bytes; b++)
+			tiff += char(value >> (8 * b));
+	};
+
+	//Header, then the directory straight after it, then the bits per sample array and the pixels
+	const int entries = 11;
+	const uint32_t directoryEnd = 8 + 2 + entries * 12 + 4, pixelOffset = directoryEnd + 6;
+	tiff += "II";
+	append(42, 2);
+	append(8, 4);
+	append(entries, 2);
+	auto entry = [&](int tag, int type, uint32_t count, uint32_t value) {
+		append(tag, 2);
+		append(type, 2);
+		append(count, 4);
+		append(value, type == 3 && count == 1 ? 2 : 4);
+		if (type == 3 && count == 1)
+			append(0, 2);
+	};
+	entry(256, 4, 1, width); //ImageWidth
+	entry(257, 4, 1, height); //ImageLength
+	if (channels == 3)
+		entry(258, 3, 3, directoryEnd); //BitsPerSample, one for each sample
 	else
+		entry(258, 3, 1, 8 * sizeof(Sample));
+	entry(259, 3, 1, 1); //Compression: none
+	entry(262, 3, 1, channels == 3 ? 2 : 1); //PhotometricInterpretation: RGB or black is zero
+	entry(273, 4, 1, pixelOffset); //StripOffsets
+	entry(277, 3, 1, channels); //SamplesPerPixel
+	entry(278, 4, 1, height); //RowsPerStrip
+	entry(279, 4, 1, pixelBytes); //StripByteCounts
+	entry(284, 3, 1, 1); //PlanarConfiguration: interleaved
+	entry(339, 3, 1, std::is_floating_point<Sample>::value ? 3 : 1); //SampleFormat: floating point or unsigned
+	append(0, 4); //No more directories
+	for (int c = 0; c < 3; c++)
+		append(8 * sizeof(Sample), 2);
+
+	//CImg stores each channel as a separate plane, while TIFF interleaves them
+	tiff.reserve(pixelOffset + size_t(pixelBytes));
+	for (int y = 0; y < height; y++)
 	{
-		for (int i = env->MIX_X + env->CONC_OFFSET; i < env->WIDTH; i++)
+		for (int x = 0; x < width; x++)
 		{
-			for (int j = 0; j < env->HEIGHT; j++)
-			{
-				TOT_THICK[int(getConcValue(concImage, i, j) / binSize)] += float(biofilmImage->operator()(i, j, 0)) / 255.f*env->MAX_THICKNESS;
-				NUM_THICK[int(getConcValue(concImage, i, j) / binSize)] += 1;
-			}
+			for (int c = 0; c < channels; c++)
+				appendLittleEndian(&tiff, image(x, y, 0, c));
 		}
+	}
+	return tiff;
+}
 
-		for (int j = 0; j < int(100.f / binSize); j++)
-		{
-			if (NUM_THICK[j] > 0)
-			{
-				AV_THICKNESS[j] = TOT_THICK[j] / NUM_THICK[j];
-			}
+template std::string encodeTiff<unsigned char>(const cimg_library::CImg<unsigned char>& image);
+template std::string encodeTiff<float>(const cimg_library::CImg<float>& image);
+
+//Encode a grey floating point image as a NumPy .npy array of HEIGHT rows by WIDTH columns
+std::string encodeNpy(const cimg_library::CImg<float>& image)
+{
+	//The header is padded with spaces so the data starts on a 64-byte boundary
+	std::string header = "{'descr': '<f4', 'fortran_order': False, 'shape': (" + std::to_string(image.height()) + ", " + std::to_string(image.width()) + "), }";
+	header.append(63 - (10 + header.size()) % 64, ' ');
+	header += '\n';
+
+	std::string npy = "\x93NUMPY\x01";
+	npy += '\0';
+	npy += char(header.size() & 255);
+	npy += char(header.size() >> 8);
+	npy += header;
+	npy.reserve(npy.size() + image.size() * sizeof(float));
+	for (size_t p = 0; p < image.size(); p++)
+		appendLittleEndian(&npy, image[p]);
+	return npy;
+}
+
+void writeFile(const std::string& fileName, const std::string& contents)
+{
+	std::ofstream file(fileName, std::ios::binary);
+	file.write(contents.data(), contents.size());
+	file.close();
+	if (!file)
+		throw "Could not write an output file: please check that the output folder can be written to";
+}
+
+OutputWriter::~OutputWriter()
+{
+	for (std::thread& job : jobs)
+		job.join();
+}
+
+void OutputWriter::fail(const char* msg)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	errors.push_back(msg);
+}
+
+void OutputWriter::saveImage(cimg_library::CImg<unsigned char> image, const std::string& name, EnvironmentVariables* env)
+{
+	const std::string format = env->OUTPUT_FORMAT;
+	const int threads = env->THREADS;
+	jobs.emplace_back([this, format, threads, name](cimg_library::CImg<unsigned char> image) {
+		try {
+			if (format == "png")
+				writeFile(name + ".png", encodePng(image, threads));
+			else if (format == "tiff")
+				writeFile(name + ".tif", encodeTiff(image));
+			else
+				image.save_bmp((name + ".bmp").c_str());
+		}
+		catch (const char* msg) {
+			fail(msg);
+		}
+		catch (...) {
+			fail("Could not write an output file: please check that the output folder can be written to");
+		}
+	}, std::move(image));
+}
+
+void OutputWriter::saveThickness(std::vector<int> thickness, const std::string& name, EnvironmentVariables* env)
+{
+	const std::string format = env->SAVE_THICKNESS;
+	const int width = env->WIDTH, height = env->HEIGHT;
+	const float layerThickness = env->LAYER_THICKNESS;
+	jobs.emplace_back([this, format, width, height, layerThickness, name](std::vector<int> thickness) {
+		try {
+			cimg_library::CImg<float> map(width, height);
+			for (size_t p = 0; p < map.size(); p++)
+				map[p] = thickness[p] * layerThickness;
+
+			if (format == "tiff")
+				writeFile(name + ".tif", encodeTiff(map));
+			else if (format == "npy")
+				writeFile(name + ".npy", encodeNpy(map));
 			else
 			{
-				AV_THICKNESS[j] = 0.f;
+				std::string raw;
+				raw.reserve(map.size() * sizeof(float));
+				for (size_t p = 0; p < map.size(); p++)
+					appendLittleEndian(&raw, map[p]);
+				writeFile(name + ".raw", raw);
 			}
 		}
-	}
+		catch (const char* msg) {
+			fail(msg);
+		}
+		catch (...) {
+			fail("Could not write an output file: please check that the output folder can be written to");
+		}
+	}, std::move(thickness));
+}
+
+void OutputWriter::saveText(std::string text, const std::string& fileName)
+{
+	jobs.emplace_back([this, fileName](std::string text) {
+		try {
+			writeFile(fileName, text);
+		}
+		catch (const char* msg) {
+			fail(msg);
+		}
+	}, std::move(text));
+}
 
-	std::ofstream outfile;
-	outfile.open((env->imageFolderName + "_exma_analysis/thickness-vs-concentration.csv").c_str());
-	outfile.clear();
-	outfile << "% concentration upper stream, thickness (micrometers)\n";
+void OutputWriter::finish()
+{
+	for (std::thread& job : jobs)
+		job.join();
+	jobs.clear();
 
-	for (int j = 0; j < int(100.f / binSize); j++)
+	std::lock_guard<std::mutex> guard(lock);
+	if (!errors.empty())
 	{
-		outfile << std::to_string(float(j*binSize)) << "," << std::to_string(AV_THICKNESS[j]) << "\n";
-	}
-
-	outfile.close();
-}
-
-colour getHeatmapColour(int val)
-{
-	colour returnCol;
-	returnCol.R = 0;
-	returnCol.G = 0;
-	returnCol.B = 0;
-
-	switch (int(val / (256.f / 6.f)))
-	{
-	case 0: //Black to Blue
-		returnCol.B = val * 6.f;
-		break;
-	case 1: //Blue to Cyan
-		returnCol.B = 255;
-		returnCol.G = (val - 1.f*256.f/6.f) * 6.f * 0.9f;
-		break;
-	case 2: //Cyan to Green
-		returnCol.G = 255*0.9f;
-		returnCol.B = 255 - (val - 2.f*256.f / 6.f) * 6.f;
-		break;
-	case 3: //Green to Yellow
-		returnCol.G = 255* 0.9f;
-		returnCol.R = (val - 3.f*256.f / 6.f) * 6.f;
-		break;
-	case 4: //Yellow to Red
-		returnCol.R = 255;
-		returnCol.G = 255 - (val - 4.f*256.f / 6.f) * 6.f* 0.9f;
-		break;
-	case 5: //Red to White
-		returnCol.R = 255;
-		returnCol.G = (val - 5.f*256.f / 6.f) * 6.f;
-		returnCol.B = (val - 5.f*256.f / 6.f) * 6.f;
-		break;
-	default:
-		break;
-	}
-
-	return returnCol;
+		const char* msg = errors[0];
+		errors.clear();
+		throw msg;
+	}
 }
 
 void iniInput(std::string iniFile, EnvironmentVariables* env)
@@ -0,0 +1,388 @@
+﻿//Shared declarations for the exma analysis, used by the exma executable and the exma_bench benchmarks
+
+#pragma once
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef _MSC_VER
+#include <intrin.h> //Bit scan and popcount intrinsics
+#endif
+#include <filesystem> //File manipulation
+#ifndef _WIN32
+#include <sys/mman.h> //Memory-mapped layers
+#include <fcntl.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define EXMA_IO_URING
+#include <linux/io_uring.h> //Asynchronous read-ahead of layer files, through the raw system calls
+#include <sys/syscall.h>
+#endif
+#ifdef EXMA_ZLIB
+#include <zlib.h> //Compression of PNG outputs
+#endif
+#include "CImg.h" //Image processor
+
+namespace fs = std::filesystem;
+
+//Holds important environment values between contexts
+struct EnvironmentVariables
+{
+	//File-specific variables
+	int HEIGHT, WIDTH, DEPTH;
+	int BIT_DEPTH = 8; //Bits per sample of the input: 8 for BMP folders, 8 or 16 for TIFF stacks
+	bool FACING;
+	bool STACK_FILE = false; //The input is one multi-page TIFF holding every layer, rather than a folder of layer images
+	std::string imageFolderName;
+	std::vector<std::string> imageFileNames;
+	std::string OUTPUT_FORMAT = "bmp"; //Image format of the saved outputs: bmp, png or tiff
+	std::string SAVE_THICKNESS; //Format of the thickness map in micrometers: raw, tiff or npy, or empty to not save it
+	std::string AUTO_THRESHOLD; //Method THRESHOLD is chosen by from the stack's histogram: otsu, triangle or li, or empty to use -m
+
+	//Command line arg variables
+	int TABLE_BIN_SIZE, MAX_SPACE, CONC_STEP, THRESHOLD, LAYER_MEDIAN, LAYER_BLUR, DISP_PERCENT, DISP_HEIGHT, DISP_WIDTH, CONC_OFFSET, CONC_FIDELITY, THREADS, CHANNEL, MEM_BUDGET, READ_AHEAD;
+	bool DISPLAY, SAVE, SAVE_CONC, CACHE, STREAM, VERBOSE, OVERLAY, TABLE, BINARIZE, A_BIOFILM = true, A_CONCENTRATION;
+	float SMOOTH_3D = 0.f; //Standard deviation in micrometers of the 3D Gaussian smoothing of the stack, 0 for none
+
+	//Values that are determined in program
+	int MIX_X, MIX_Y;
+	float MAX_THICKNESS; //Thickest biofilm in micrometers, that the output images are scaled to
+
+	//Config variables, These will all be changed by the config file unless left out
+	float CROSS_AREA = 30000; // micrometers squared
+	float FLOW_RATE = 5.f; //microliters per hour
+	float PIXEL_WIDTH = 0.15; //micrometers
+	float LAYER_THICKNESS = 1.f; //micrometers
+	float DIFFUSIVITY = 1000.f; //micrometers squared per second
+	float CHAN_WIDTH = 350.f; //micrometers
+};
+
+//A read-only memory mapping of a whole file, or the file's contents when they were read into memory instead
+struct MappedFile
+{
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+	std::vector<unsigned char> contents; //Only used for files read into memory
+
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	bool open(const std::string& fileName); //False if the file cannot be mapped (missing or empty)
+	void adopt(std::vector<unsigned char>&& fileContents); //Use contents already read from the file instead of a mapping
+	void close();
+};
+
+//Holds the analysed channel of every layer, with each pixel's z-column stored contiguously
+//The voxels are either owned, or mapped read-only from a stack cache written by an earlier run
+template<typename Sample>
+struct VoxelStack
+{
+	int HEIGHT = 0, WIDTH = 0, DEPTH = 0;
+	std::vector<Sample> voxels; //Owned voxels, empty when the stack is mapped from a cache
+	const Sample* data = nullptr; //data[(y * WIDTH + x) * DEPTH + z], pointing into voxels or the cache
+	MappedFile cache;
+
+	void allocate(int width, int height, int depth)
+	{
+		WIDTH = width;
+		HEIGHT = height;
+		DEPTH = depth;
+		cache.close();
+		voxels.assign(size_t(height) * width * depth, 0);
+		data = voxels.data();
+	}
+
+	Sample* column(int x, int y) { return &voxels[(size_t(y) * WIDTH + x) * DEPTH]; } //Only for filling an allocated stack
+	const Sample* column(int x, int y) const { return data + (size_t(y) * WIDTH + x) * DEPTH; }
+};
+
+typedef VoxelStack<unsigned char> ImageStack; //8-bit images
+typedef VoxelStack<uint16_t> ImageStack16; //12 and 16-bit TIFF stacks, kept at their native depth
+
+//Holds one bit per voxel (set when above THRESHOLD), with each pixel's z-column packed into 64-bit words
+struct BitStack
+{
+	int HEIGHT = 0, WIDTH = 0, DEPTH = 0, WORDS = 0; //WORDS is the number of 64-bit words per column
+	std::vector<uint64_t> bits; //Layer z of a column is bit (z % 64) of word (z / 64)
+
+	uint64_t* column(int x, int y) { return &bits[(size_t(y) * WIDTH + x) * WORDS]; }
+	const uint64_t* column(int x, int y) const { return &bits[(size_t(y) * WIDTH + x) * WORDS]; }
+};
+
+//A read-only memory mapping (or in-memory copy) of an uncompressed 8-bit palettized or 24-bit BMP, so its rows can be read without decoding the file
+struct MappedBmp
+{
+	int WIDTH = 0, HEIGHT = 0, BITS = 0;
+	const unsigned char* pixels = nullptr; //First row of the image as it is displayed (the last row stored for bottom-up files)
+	ptrdiff_t stride = 0; //Bytes from one displayed row to the next, negative for bottom-up files
+	unsigned char palette[256] = {}; //Value of the mapped channel for each palette index of an 8-bit file
+	int channelOffset = 0; //Byte of the mapped channel within each pixel of a 24-bit file (stored as BGR)
+
+	bool open(const std::string& imageName, int channel); //False if the file is not a BMP this reader understands
+	bool open(std::vector<unsigned char>&& fileContents, int channel); //The same, for a file that has already been read
+	void close();
+	bool isOpen() const { return pixels != nullptr; }
+	const unsigned char* row(int y) const { return pixels + y * stride; }
+
+private:
+	MappedFile file;
+
+	bool parse(int channel);
+};
+
+//A memory mapping of an uncompressed multi-page TIFF or BigTIFF (such as an OME-TIFF from the microscope), with the layers stored as pages
+struct TiffStack
+{
+	int WIDTH = 0, HEIGHT = 0, DEPTH = 0, BITS = 0; //BITS per sample, 8 or 16
+	int SAMPLES = 0, CHANNELS = 1; //SAMPLES per pixel (interleaved), and OME-TIFF channels stored as separate pages
+
+	void open(const std::string& fileName); //Throws if the file is not a stack this reader understands
+	int page(int layer, int channel) const; //Page holding a layer of a channel
+	const unsigned char* rowData(int page, int y) const; //Row y of a page as stored in the file
+
+	//Copy one sample of every pixel in row y of a page into out, converted to the machine's byte order
+	template<typename Sample> void readRow(int page, int y, int sample, Sample* out) const;
+
+private:
+	MappedFile file;
+	bool bigEndian = false;
+	int64_t strideZ = 1, strideC = 0; //Pages between successive layers and channels, from the OME dimension order
+	std::vector<std::vector<uint64_t>> strips; //Offsets of each page's strips
+	std::vector<int> rowsPerStrip; //Of each page
+
+	uint64_t read(uint64_t offset, int bytes) const;
+};
+
+struct IoRing; //io_uring submission and completion rings, only defined where the kernel headers have them
+
+//Reads whole layer files into memory ahead of the loader, keeping a window of files in flight so the device sees many reads at once
+//rather than one file at a time. Uses io_uring on Linux when the kernel allows it, and a pool of reading threads otherwise
+struct LayerReadAhead
+{
+	LayerReadAhead() = default;
+	LayerReadAhead(const LayerReadAhead&) = delete;
+	LayerReadAhead& operator=(const LayerReadAhead&) = delete;
+	~LayerReadAhead() { stop(); }
+
+	//Start reading the files in order, with at most window files read but not yet taken
+	void start(const std::vector<std::string>* fileNames, int window, bool verbose);
+	bool take(int layer, std::vector<unsigned char>* fileContents); //Wait for a file to be read; false if it could not be read
+	void stop();
+
+private:
+	enum State : char { PENDING, READ, FAILED, TAKEN };
+
+	const std::vector<std::string>* names = nullptr;
+	std::vector<std::vector<unsigned char>> contents;
+	std::vector<State> states;
+	int window = 0, nextLayer = 0, firstUntaken = 0; //nextLayer is the next file to read, firstUntaken the lowest layer not yet taken
+	bool stopping = false;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::vector<std::thread> workers;
+	IoRing* ring = nullptr;
+
+	bool canRead() const { return nextLayer < int(states.size()) && nextLayer < firstUntaken + window; }
+	void finish(int layer, bool read, std::vector<unsigned char>* fileContents); //Called with lock held
+	void readThread();
+	void ringThread();
+};
+
+//A layer of the stack, either mapped straight from its file or decoded (and blurred) by CImg, holding only the analysed channel
+template<typename Sample>
+struct Layer
+{
+	MappedBmp mapped;
+	const TiffStack* tiff = nullptr; //Set when the layer is a page of a TIFF stack
+	int page = 0, sample = 0;
+	cimg_library::CImg<Sample> image; //Used when the layer is neither mapped nor a page
+	int rowOffset = 0; //Row of the layer held in the first row of image (or mask), when only a band of rows was loaded
+	std::vector<uint64_t> mask; //Only set for layers that were blurred and thresholded in one pass: one bit per pixel, set above THRESHOLD
+	int maskWords = 0; //64-bit words per row of mask
+
+	//Row y of the analysed channel. Mapped rows are unpacked into buffer (WIDTH samples), decoded rows are returned in place
+	const Sample* row(int y, Sample* buffer) const;
+	const uint64_t* maskRow(int y) const { return &mask[size_t(y - rowOffset) * maskWords]; } //Bit x % 64 of word x / 64 is pixel x
+};
+
+//Encodes and writes output files on background threads, so the analysis and the display carry on while they are written
+struct OutputWriter
+{
+	OutputWriter() = default;
+	OutputWriter(const OutputWriter&) = delete;
+	OutputWriter& operator=(const OutputWriter&) = delete;
+	~OutputWriter();
+
+	//Save an image as name plus the extension of env->OUTPUT_FORMAT
+	void saveImage(cimg_library::CImg<unsigned char> image, const std::string& name, EnvironmentVariables* env);
+	void saveThickness(std::vector<int> thickness, const std::string& name, EnvironmentVariables* env); //From the confirmed layers of every pixel
+	void saveText(std::string text, const std::string& fileName);
+	void finish(); //Wait for every file to be written, throwing if any could not be
+
+private:
+	std::vector<std::thread> jobs;
+	std::vector<const char*> errors;
+	std::mutex lock;
+
+	void fail(const char* msg);
+};
+
+//Holds the colour values of a pixel
+struct colour
+{
+	int R, G, B;
+};
+
+//Heatmap colour of a value between 0 and 255, from black through blue, cyan, green, yellow and red to white
+constexpr colour getHeatmapColour(int val)
+{
+	colour returnCol = { 0, 0, 0 };
+
+	switch (int(val / (256.f / 6.f)))
+	{
+	case 0: //Black to Blue
+		returnCol.B = val * 6.f;
+		break;
+	case 1: //Blue to Cyan
+		returnCol.B = 255;
+		returnCol.G = (val - 1.f*256.f/6.f) * 6.f * 0.9f;
+		break;
+	case 2: //Cyan to Green
+		returnCol.G = 255*0.9f;
+		returnCol.B = 255 - (val - 2.f*256.f / 6.f) * 6.f;
+		break;
+	case 3: //Green to Yellow
+		returnCol.G = 255* 0.9f;
+		returnCol.R = (val - 3.f*256.f / 6.f) * 6.f;
+		break;
+	case 4: //Yellow to Red
+		returnCol.R = 255;
+		returnCol.G = 255 - (val - 4.f*256.f / 6.f) * 6.f* 0.9f;
+		break;
+	case 5: //Red to White
+		returnCol.R = 255;
+		returnCol.G = (val - 5.f*256.f / 6.f) * 6.f;
+		returnCol.B = (val - 5.f*256.f / 6.f) * 6.f;
+		break;
+	default:
+		break;
+	}
+
+	return returnCol;
+}
+
+//Heatmap colours of all 256 values, kept as separate R, G and B tables to match CImg's planar channels
+struct HeatmapTable
+{
+	unsigned char R[256], G[256], B[256];
+};
+
+constexpr HeatmapTable makeHeatmapTable()
+{
+	HeatmapTable table = {};
+	for (int val = 0; val < 256; val++)
+	{
+		colour Col = getHeatmapColour(val);
+		table.R[val] = (unsigned char)Col.R;
+		table.G[val] = (unsigned char)Col.G;
+		table.B[val] = (unsigned char)Col.B;
+	}
+	return table;
+}
+
+constexpr HeatmapTable HEATMAP = makeHeatmapTable();
+
+//Functions Declarations
+void setEnvironmentVariables(EnvironmentVariables* env);
+template<typename Sample> void loadImages(VoxelStack<Sample>* stack, EnvironmentVariables* env); //Instantiated for ImageStack and ImageStack16
+void loadImages(BitStack* stack, EnvironmentVariables* env);
+void streamThickness(std::vector<int>* OUTPUT, EnvironmentVariables* env);
+std::string describeStackCache(EnvironmentVariables* env, size_t sampleBytes);
+int otsuThreshold(const std::vector<uint64_t>& histogram);
+int triangleThreshold(const std::vector<uint64_t>& histogram);
+int liThreshold(const std::vector<uint64_t>& histogram);
+void selectThreshold(const std::vector<uint64_t>& histogram, EnvironmentVariables* env);
+template<typename Sample> bool mapStackCache(VoxelStack<Sample>* stack, EnvironmentVariables* env);
+template<typename Sample> void saveStackCache(const VoxelStack<Sample>& stack, EnvironmentVariables* env);
+cimg_library::CImg<unsigned char> loadPreviewLayer(EnvironmentVariables* env);
+bool readImageSize(const std::string& imageName, int* width, int* height);
+void initDimensions(EnvironmentVariables* env);
+cimg_library::CImg<unsigned char> decodeLayer(const std::string& imageName, EnvironmentVariables* env);
+template<typename Sample> void loadLayer(int layerIndex, const TiffStack* tiff, LayerReadAhead* readAhead, int firstRow, int endRow, bool thresholded, EnvironmentVariables* env, Layer<Sample>* layer);
+bool filteredLayers(EnvironmentVariables* env);
+int blurHalo(EnvironmentVariables* env);
+template<typename Sample> void medianLayer(cimg_library::CImg<Sample>* image, int radius, int threads); //Instantiated for unsigned char and uint16_t
+float smoothingSigmaXY(EnvironmentVariables* env);
+float smoothingSigmaZ(EnvironmentVariables* env);
+int smoothingRadius(EnvironmentVariables* env);
+std::vector<float> smoothingWeights(EnvironmentVariables* env);
+template<typename Sample> void blurLayer(cimg_library::CImg<Sample>* image, float sigma); //Instantiated for unsigned char and uint16_t
+template<typename Sample> void blurThreshold(cimg_library::CImg<Sample>* image, float sigma, int threshold, std::vector<uint64_t>* mask); //Instantiated for unsigned char and uint16_t
+int loadBatchSize(bool tiff, EnvironmentVariables* env);
+int loadedLayers(bool tiff, EnvironmentVariables* env);
+size_t fullSizeBytes(EnvironmentVariables* env);
+int tileRows(EnvironmentVariables* env, size_t bytesPerRow, size_t bytesPerHaloRow);
+void checkMemBudget(size_t bytesPerRow, size_t bytesPerHaloRow, EnvironmentVariables* env);
+void drawOverlay(cimg_library::CImg<unsigned char> *drawImage, EnvironmentVariables* env);
+void calcBinnedThickness(cimg_library::CImg<float> *concImage, cimg_library::CImg<unsigned char> *biofilmImage, OutputWriter* writer, EnvironmentVariables* env);
+void binThickness(cimg_library::CImg<float> *concRows, int firstRow, cimg_library::CImg<unsigned char> *biofilmImage, std::vector<uint64_t>* counts, EnvironmentVariables* env);
+void writeBinnedThickness(const std::vector<uint64_t>& counts, OutputWriter* writer, EnvironmentVariables* env);
+void calcConcentrationTiles(cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* packedImage, OutputWriter* writer, EnvironmentVariables* env);
+std::string encodePng(const cimg_library::CImg<unsigned char>& image, int threads); //Only in builds with zlib
+template<typename Sample> std::string encodeTiff(const cimg_library::CImg<Sample>& image); //Instantiated for unsigned char and float
+std::string encodeNpy(const cimg_library::CImg<float>& image);
+void appendLittleEndian(std::string* out, unsigned char value);
+void appendLittleEndian(std::string* out, float value);
+void writeFile(const std::string& fileName, const std::string& contents);
+void drawAt(cimg_library::CImg<unsigned char> *image, int x, int y, int R, int G, int B, int size, EnvironmentVariables* env);
+void iniInput(std::string iniFile, EnvironmentVariables* env);
+float getConcValue(cimg_library::CImg<float> *image, int x, int y);
+template<typename Stack> void measureThickness(const Stack* stack, EnvironmentVariables* env, std::vector<int>* OUTPUT); //Instantiated for ImageStack, ImageStack16 and BitStack
+template<typename Stack> void calcBiofilm(const Stack* stack, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage); //Instantiated for ImageStack, ImageStack16 and BitStack
+template<typename Sample> int columnThickness(const Sample* column, EnvironmentVariables* env); //Instantiated for unsigned char and uint16_t
+int columnThickness(const uint64_t* column, EnvironmentVariables* env);
+cimg_library::CImg<float> calcConcentrationGradient(EnvironmentVariables* env);
+cimg_library::CImg<float> calcConcentrationRows(EnvironmentVariables* env, int firstRow, int endRow);
+cimg_library::CImg<unsigned char> packConcentration(const cimg_library::CImg<float>& concImage);
+void multiplyBlocked(const float* a, const float* b, float* out, int firstRow, int endRow, int firstCol, int endCol, int cols, int depth);
+float concColumnTerm(EnvironmentVariables* env, int k, int x);
+float concRowTerm(EnvironmentVariables* env, int k, int y);
+float concFromSeries(EnvironmentVariables* env, float sum);
+int findIsoline(EnvironmentVariables* env, const std::vector<float>& columnTerms, float level, bool lowestOnTop);
+float getConcAt(EnvironmentVariables* env, int x, int y);
+void drawThickness(const std::vector<int>& OUTPUT, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage);
+void drawBiofilm(const std::vector<int>& thickness, int maxVal, EnvironmentVariables* env, cimg_library::CImg<unsigned char>* biofilmImage, cimg_library::CImg<unsigned char>* displayImage);
+
+//Split rows [0, rows) into one contiguous band per thread and run func(firstRow, endRow, band) on each band
+template<typename Func>
+void parallelRows(int rows, int threads, Func func)
+{
+	threads = std::max(1, std::min(threads, rows));
+	if (threads == 1)
+	{
+		func(0, rows, 0);
+		return;
+	}
+
+	std::vector<std::thread> pool;
+	for (int t = 0; t < threads; t++)
+	{
+		pool.emplace_back(func, int(int64_t(rows) * t / threads), int(int64_t(rows) * (t + 1) / threads), t);
+	}
+	for (std::thread& worker : pool)
+	{
+		worker.join();
+	}
+}
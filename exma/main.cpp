@@ -0,0 +1,303 @@
+﻿//Tyson Klein 2018
+
+#include "exma.h"
+#include "cxxopts.hpp" //Command line argument parser
+
+void parseArgs(int argc, char* argv[], EnvironmentVariables* env);
+
+int main(int argc, char* argv[])
+{
+	/////////////////////////////////////////////////////////////////////////////////
+	//SET UP ENVIRONMENT
+		//Create the environment variables for this analysis
+		EnvironmentVariables env;
+
+		//Parse command line args, setting most environment variables
+		parseArgs(argc, argv, &env);
+	
+		//Verify that environment variables are correct, then set file names for analysis	
+		try {
+			if (env.VERBOSE)
+				std::cout << "Examining ini file..." << std::endl;
+			iniInput("exma.ini", &env);
+			if (env.VERBOSE)
+				std::cout << "Examining images..." << std::endl;
+			setEnvironmentVariables(&env);
+		}
+		catch (const char* msg) {
+			std::cerr << msg << std::endl;
+			return 0;
+		}
+
+		//Make the stack holding the vertical slices of the 3D data, either as intensities or as thresholded bits
+		ImageStack imageStack;
+		ImageStack16 imageStack16;
+		BitStack bitStack;
+
+		//Confirmed layers of every pixel. In streaming mode the stack is never held, and only this is kept
+		std::vector<int> thickness;
+	
+		//Streaming and tiled runs never hold the stack, so there is nothing to binarize or cache
+		if ((env.STREAM || env.MEM_BUDGET > 0) && (env.BINARIZE || env.CACHE))
+			std::cout << "Warning: --binarize and --cache have no effect with --stream or --mem_budget" << std::endl;
+
+		//A filtered stack is only ever thresholded, so its layers are thresholded as they are filtered and kept as bits, unless
+		//the threshold is to be chosen from the stack, which needs the intensities loaded first
+		if (filteredLayers(&env) && env.AUTO_THRESHOLD.empty())
+			env.BINARIZE = true;
+
+		//Verify that environment variables are correct and load each image into the stack
+		try {
+			if (env.VERBOSE)
+				std::cout << "Loading Images..." << std::endl;
+			if (env.STREAM || env.MEM_BUDGET > 0)
+				streamThickness(&thickness, &env);
+			else if (env.BINARIZE)
+				loadImages(&bitStack, &env);
+			else if (env.BIT_DEPTH > 8)
+				loadImages(&imageStack16, &env);
+			else
+				loadImages(&imageStack, &env);
+		}
+		catch (const char* msg) {
+			std::cerr << msg << std::endl;
+			return 0;
+		}
+
+		//Folder for outputs
+		if (!fs::is_directory(env.imageFolderName + "_exma_analysis") || !fs::exists(env.imageFolderName + "_exma_analysis"))
+		{
+			if (env.VERBOSE)
+				std::cout << "Creating output folder..." << std::endl;
+			fs::create_directory(env.imageFolderName + "_exma_analysis"); // create src folder
+		}
+	/////////////////////////////////////////////////////////////////////////////////
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//If concentration gradient is needed, prompt user to click mixing point (unless it was given on the command line)
+		if (env.A_CONCENTRATION && (env.MIX_X < 0 || env.MIX_Y < 0))
+		{
+#if cimg_display == 0
+			std::cerr << "This build of exma has no display: please give the mixing point with --mix_x and --mix_y" << std::endl;
+			return 0;
+#else
+			std::cout << "Please click on the mixing point (tip of the divider where two streams meet)" << std::endl;
+
+			cimg_library::CImg<unsigned char> bottom_layer = loadPreviewLayer(&env);
+			cimg_library::CImgDisplay point_disp(bottom_layer, "Please click on the mixing point");
+
+			point_disp.resize(env.DISP_WIDTH, env.DISP_HEIGHT, true);
+
+			static bool point_selected = false;
+
+			while (!point_disp.is_closed() && !point_selected) {
+				if (point_disp.button() & 1) { // Left button clicked
+					if (point_disp.mouse_x() >= 0 && point_disp.mouse_y() >= 0)
+					{
+						env.MIX_X = point_disp.mouse_x() / (float(env.DISP_PERCENT)*0.01f);
+						env.MIX_Y = point_disp.mouse_y() / (float(env.DISP_PERCENT)*0.01f);
+						point_selected = true;
+					}
+				}
+				point_disp.wait();
+			}
+#endif
+		}
+
+		if (env.MIX_X > env.WIDTH / 2)
+		{
+			env.FACING = true; //Inlet at right
+		}
+		else
+		{
+			env.FACING = false; //Inlet at left
+		}
+	/////////////////////////////////////////////////////////////////////////////////
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//DO ANALYSIS AND COMPUTATIONS
+		
+		//Images to display for both
+		cimg_library::CImg<unsigned char> biofilm_image, display_image;
+
+		//Concentration of the upper stream at every pixel, in %
+		cimg_library::CImg<float> concentration_image;
+
+		//Output files are written in the background from here on
+		OutputWriter writer;
+
+		//Record the threshold that was chosen from the stack
+		if (!env.AUTO_THRESHOLD.empty())
+			writer.saveText("THRESHOLD=" + std::to_string(env.THRESHOLD) + "#Chosen by --auto_threshold " + env.AUTO_THRESHOLD + "\n", env.imageFolderName + "_exma_analysis/threshold.ini");
+
+		//With a memory budget the concentration is computed a band of rows at a time further down, and never held in full
+		const bool tiled = env.MEM_BUDGET > 0;
+
+		//If concentration gradient needs to be calculated (the overlay traces its lines from the series directly)
+		if (env.A_CONCENTRATION && ((env.TABLE && env.A_BIOFILM) || env.SAVE_CONC) && !tiled)
+		{
+			if (env.VERBOSE)
+				std::cout << "Calculating concentration gradient..." << std::endl;
+			concentration_image = calcConcentrationGradient(&env);
+		}
+
+		//If biofilm thickness needs to be calculated
+		if (env.A_BIOFILM)
+		{
+			if (env.VERBOSE)
+				std::cout << "Calculating biofilm data..." << std::endl;
+			if (env.STREAM || tiled)
+				; //Measured while loading
+			else if (env.BINARIZE)
+				measureThickness(&bitStack, &env, &thickness);
+			else if (env.BIT_DEPTH > 8)
+				measureThickness(&imageStack16, &env, &thickness);
+			else
+				measureThickness(&imageStack, &env, &thickness);
+			drawThickness(thickness, &env, &biofilm_image, &display_image);
+		}
+
+		//If table of data needs to be calculated
+		if (env.A_CONCENTRATION && env.TABLE && env.A_BIOFILM)
+		{
+			if (env.VERBOSE)
+				std::cout << "Exporting table: thickness vs. concentration..." << std::endl;
+			if (tiled)
+				calcConcentrationTiles(&biofilm_image, nullptr, &writer, &env);
+			else
+				calcBinnedThickness(&concentration_image, &biofilm_image, &writer, &env);
+		}
+
+		//If overlay needs to be calculated
+		if (env.OVERLAY && env.A_BIOFILM)
+		{
+			if (env.VERBOSE)
+				std::cout << "Adding overlay to display..." << std::endl;
+			drawOverlay(&display_image, &env);
+		}
+
+		//Saving all data
+		if (env.SAVE)
+		{
+			if (env.VERBOSE)
+				std::cout << "Saving images..." << std::endl;
+			writer.saveImage(display_image, env.imageFolderName + "_exma_analysis/biofilm_display_image", &env);
+			writer.saveImage(std::move(biofilm_image), env.imageFolderName + "_exma_analysis/biofilm_data", &env);
+		}
+
+		if (!env.SAVE_THICKNESS.empty() && env.A_BIOFILM)
+		{
+			if (env.VERBOSE)
+				std::cout << "Saving thickness map..." << std::endl;
+			writer.saveThickness(std::move(thickness), env.imageFolderName + "_exma_analysis/thickness_um", &env);
+		}
+
+		if (env.SAVE_CONC && env.A_CONCENTRATION)
+		{
+			if (env.VERBOSE)
+				std::cout << "Saving concentration gradient..." << std::endl;
+			cimg_library::CImg<unsigned char> packed_image;
+			if (tiled)
+				calcConcentrationTiles(nullptr, &packed_image, &writer, &env);
+			else
+				packed_image = packConcentration(concentration_image);
+			writer.saveImage(std::move(packed_image), env.imageFolderName + "_exma_analysis/concentration_packed", &env);
+		}
+
+		if (env.VERBOSE)
+			std::cout << "Displaying final data..." << std::endl;		
+
+		//Display the display image
+		if (env.DISPLAY && env.A_BIOFILM)
+		{
+#if cimg_display == 0
+			std::cerr << "This build of exma has no display: use -s to save the outputs instead" << std::endl;
+#else
+			cimg_library::CImgDisplay main_disp(display_image, "Biofilm Thickness");
+
+			main_disp.resize(env.DISP_WIDTH, env.DISP_HEIGHT, true);
+
+			while (!main_disp.is_closed()) {
+				main_disp.wait();
+			}
+#endif
+		}
+
+		try {
+			writer.finish();
+		}
+		catch (const char* msg) {
+			std::cerr << msg << std::endl;
+		}
+
+}
+
+//cxxopts implementation od a command line argument parser
+void parseArgs(int argc, char* argv[], EnvironmentVariables* env)
+{
+	cxxopts::Options options("exma", "Analysis of extracelluar matrix and biofilm data");
+
+	try {
+		options
+			.positional_help("[optional args]")
+			.show_positional_help();
+
+		options.add_options("Input/Output") //For all variables influencing the input
+			("f,folder", "Folder name containing image data, or a multi-page TIFF stack", cxxopts::value<std::string>(env->imageFolderName))
+			("s,save", "Save all outputs as images", cxxopts::value<bool>(env->SAVE))
+			("format", "Image format of the saved outputs: bmp, png or tiff", cxxopts::value<std::string>(env->OUTPUT_FORMAT)->default_value("bmp"))
+			("save_thickness", "Save the thickness of every pixel in micrometers as 32-bit floats: raw, tiff or npy", cxxopts::value<std::string>(env->SAVE_THICKNESS))
+			("save_conc", "Save the concentration gradient as a 24-bit packed image", cxxopts::value<bool>(env->SAVE_CONC))
+			("cache", "Keep the loaded stack in the output folder and reuse it on later runs", cxxopts::value<bool>(env->CACHE))
+			("read_ahead", "Number of layer files read ahead of the decoder (0 maps each file when it is needed)", cxxopts::value<int>(env->READ_AHEAD)->default_value("16"))
+			("mem_budget", "Memory in MB to work within, processing the image a band of rows at a time (0 for no limit)", cxxopts::value<int>(env->MEM_BUDGET)->default_value("0"))
+			("t,table", "Save thickness vs concentration as table", cxxopts::value<bool>(env->TABLE))
+			("table_bins", "Number of bins for output table", cxxopts::value<int>(env->TABLE_BIN_SIZE)->default_value("500"))
+			("o,overlay", "Overlay descriptive information on outputs", cxxopts::value<bool>(env->OVERLAY))
+			("d,display", "Display all outputs to screen", cxxopts::value<bool>(env->DISPLAY))
+			("disp_percent", "% scale of original image size", cxxopts::value<int>(env->DISP_PERCENT)->default_value("30"))
+			;
+
+		options.add_options("Biofilm") //For all variables influencing the analysis
+			("m,minimum_threshold", "Minimum intensity threshold for detection", cxxopts::value<int>(env->THRESHOLD)->default_value("50"))
+			("auto_threshold", "Choose the threshold from the histogram of the stack instead: otsu, triangle or li", cxxopts::value<std::string>(env->AUTO_THRESHOLD))
+			("layer_median", "2D median filter radius, for removing dead pixels (slower for 16-bit stacks, in proportion to the radius)", cxxopts::value<int>(env->LAYER_MEDIAN)->default_value("0"))
+			("layer_blur", "2D image blur radius", cxxopts::value<int>(env->LAYER_BLUR)->default_value("0"))
+			("smooth_3d", "3D Gaussian smoothing standard deviation in micrometers (0 for none)", cxxopts::value<float>(env->SMOOTH_3D)->default_value("0"))
+			("max_space", "Largest allowable vertical gap", cxxopts::value<int>(env->MAX_SPACE)->default_value("100"))
+			("binarize", "Store the stack as one thresholded bit per voxel", cxxopts::value<bool>(env->BINARIZE))
+			("stream", "Measure each layer as it is loaded instead of storing the stack", cxxopts::value<bool>(env->STREAM))
+			("channel", "Colour channel to analyse (0 red, 1 green, 2 blue)", cxxopts::value<int>(env->CHANNEL)->default_value("1"))
+			;
+
+		options.add_options("Concentration") //For all variables influencing the output of data
+			("c,concentration", "Concentration gradient", cxxopts::value<bool>(env->A_CONCENTRATION))
+			("conc_step", "Step size for concentration lines around 50%", cxxopts::value<int>(env->CONC_STEP)->default_value("20"))
+			("conc_offset", "Offset in pixels for start of concentration analysis from mixing point", cxxopts::value<int>(env->CONC_OFFSET)->default_value("200"))
+			("conc_fidelity", "Number of iterations to calculate concentration gradient", cxxopts::value<int>(env->CONC_FIDELITY)->default_value("30"))
+			("mix_x", "x pixel of the mixing point, instead of clicking on it", cxxopts::value<int>(env->MIX_X)->default_value("-1"))
+			("mix_y", "y pixel of the mixing point, instead of clicking on it", cxxopts::value<int>(env->MIX_Y)->default_value("-1"))
+			;
+
+		options.add_options() //Other options
+			("h, help", "Print help")
+			("v,verbose", "Verbose mode", cxxopts::value<bool>(env->VERBOSE))
+			("threads", "Number of worker threads (0 uses every core)", cxxopts::value<int>(env->THREADS)->default_value("0"))
+			;
+
+		auto result = options.parse(argc, argv);
+
+		if (env->THREADS <= 0)
+			env->THREADS = std::max(1u, std::thread::hardware_concurrency());
+
+		//If help is selected, do not continue to run the program and simply display the help text
+		if (result.count("help")) {
+			std::cout << options.help({}) << std::endl;
+			exit(0);
+		}
+	}
+	catch (const cxxopts::OptionException& e) {
+		std::cout << "error parsing options: " << e.what() << std::endl;
+		exit(-1);
+	}
+}